@@ -0,0 +1,72 @@
+#include "BlockCache.h"
+
+// rough overhead of an entry in the list and the map
+#define ENTRY_OVERHEAD 96
+
+BlockCache::BlockCache(size_t budget) :
+	m_budget(budget), m_stats()
+{
+}
+
+BlockCache::Block BlockCache::get(BlockPos pos)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_blocks.find(blockKey(pos));
+	if (it == m_blocks.end()) {
+		m_stats.misses++;
+		return Block();
+	}
+	m_stats.hits++;
+	m_lru.splice(m_lru.begin(), m_lru, it->second);
+	return it->second->block;
+}
+
+void BlockCache::put(BlockPos pos, const Block &block)
+{
+	const uint64_t key = blockKey(pos);
+	const size_t size = block->memoryUsage() + ENTRY_OVERHEAD;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_blocks.find(key) != m_blocks.end())
+		return; // another thread was faster
+	m_lru.push_front(Entry{key, block, size});
+	m_blocks[key] = m_lru.begin();
+	m_stats.memory += size;
+
+	// renders still using evicted blocks keep them alive
+	while (m_stats.memory > m_budget && !m_lru.empty()) {
+		const Entry &last = m_lru.back();
+		m_stats.memory -= last.size;
+		m_stats.evictions++;
+		m_blocks.erase(last.key);
+		m_lru.pop_back();
+	}
+	m_stats.blocks = m_blocks.size();
+}
+
+void BlockCache::erase(BlockPos pos)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_blocks.find(blockKey(pos));
+	if (it == m_blocks.end())
+		return;
+	m_stats.memory -= it->second->size;
+	m_lru.erase(it->second);
+	m_blocks.erase(it);
+	m_stats.blocks = m_blocks.size();
+}
+
+void BlockCache::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_lru.clear();
+	m_blocks.clear();
+	m_stats.memory = 0;
+	m_stats.blocks = 0;
+}
+
+BlockCache::Stats BlockCache::getStats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
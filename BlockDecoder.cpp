@@ -4,6 +4,8 @@
 
 #include "BlockDecoder.h"
 #include "ZlibDecompressor.h"
+#include "Timings.h"
+#include "Trace.h"
 
 static inline uint16_t readU16(const unsigned char *data)
 {
@@ -25,7 +27,8 @@ static inline uint16_t readBlockContent(const unsigned char *mapData,
 	}
 }
 
-BlockDecoder::BlockDecoder()
+BlockDecoder::BlockDecoder() :
+	m_timings(nullptr), m_trace(nullptr)
 {
 	reset();
 }
@@ -41,10 +44,8 @@ void BlockDecoder::reset()
 	m_mapData.clear();
 }
 
-void BlockDecoder::decode(const ustring &datastr)
+void BlockDecoder::decode(const u8 *data, size_t length)
 {
-	const unsigned char *data = datastr.c_str();
-	size_t length = datastr.length();
 	// TODO: bounds checks
 
 	uint8_t version = data[0];
@@ -58,10 +59,14 @@ void BlockDecoder::decode(const ustring &datastr)
 	ustring datastr2;
 	if (version >= 29) {
 		// decompress whole block at once
+		Timings::Scope scope(m_timings, Timings::DECOMPRESS);
+		Trace::Span span(m_trace, "decompress", "decode", true);
 		m_zstd_decompressor.setData(data, length, 1);
 		datastr2 = m_zstd_decompressor.decompress();
 		data = datastr2.c_str();
 		length = datastr2.size();
+		if (m_timings)
+			m_timings->count(Timings::BYTES_DECOMPRESSED, length);
 	}
 
 	size_t dataOffset = 0;
@@ -112,11 +117,17 @@ void BlockDecoder::decode(const ustring &datastr)
 	}
 
 	// version < 29
-	ZlibDecompressor decompressor(data, length);
-	decompressor.setSeekPos(dataOffset);
-	m_mapData = decompressor.decompress();
-	decompressor.decompress(); // unused metadata
-	dataOffset = decompressor.seekPos();
+	{
+		Timings::Scope scope(m_timings, Timings::DECOMPRESS);
+		Trace::Span span(m_trace, "decompress", "decode", true);
+		ZlibDecompressor decompressor(data, length);
+		decompressor.setSeekPos(dataOffset);
+		m_mapData = decompressor.decompress();
+		size_t metadataSize = decompressor.decompress().size(); // unused
+		dataOffset = decompressor.seekPos();
+		if (m_timings)
+			m_timings->count(Timings::BYTES_DECOMPRESSED, m_mapData.size() + metadataSize);
+	}
 
 	// Skip unused node timers
 	if (version == 23)
@@ -166,3 +177,44 @@ const std::string &BlockDecoder::getNode(u8 x, u8 y, u8 z) const
 	}
 	return it->second;
 }
+
+void BlockDecoder::resolve(DecodedBlock &out) const
+{
+	out.palette.clear();
+	out.nodes.clear();
+	out.palette.emplace_back(); // air, ignore and invalid nodes
+	if (isEmpty())
+		return;
+
+	std::unordered_map<uint16_t, uint16_t> indices;
+	bool invalid = false;
+	out.nodes.resize(4096);
+	for (unsigned int position = 0; position < 4096; position++) {
+		uint16_t content = readBlockContent(m_mapData.c_str(), m_contentWidth, position);
+		auto it = indices.find(content);
+		if (it == indices.end()) {
+			uint16_t index = 0;
+			NameMap::const_iterator name = m_nameMap.find(content);
+			if (content == m_blockAirId || content == m_blockIgnoreId) {
+				// stays empty
+			} else if (name == m_nameMap.end()) {
+				invalid = true;
+			} else {
+				index = out.palette.size();
+				out.palette.push_back(name->second);
+			}
+			it = indices.emplace(content, index).first;
+		}
+		out.nodes[position] = it->second;
+	}
+	if (invalid)
+		std::cerr << "Skipping node with invalid ID." << std::endl;
+}
+
+size_t DecodedBlock::memoryUsage() const
+{
+	size_t size = sizeof(*this) + nodes.capacity() * sizeof(uint16_t);
+	for (const auto &name : palette)
+		size += sizeof(name) + name.capacity();
+	return size;
+}
@@ -60,6 +60,27 @@ Image::Image(int width, int height) :
 	m_image = gdImageCreateTrueColor(m_width, m_height);
 }
 
+Image::Image(const std::string &filename) :
+	m_width(0), m_height(0), m_image(nullptr)
+{
+	FILE *f = fopen(filename.c_str(), "rb");
+	if (!f) {
+		std::ostringstream oss;
+		oss << "Error opening image file: " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+	m_image = gdImageCreateFromPng(f);
+	fclose(f);
+	if (!m_image)
+		throw std::runtime_error("Error loading image");
+	if (!gdImageTrueColor(m_image)) {
+		gdImageDestroy(m_image);
+		throw std::runtime_error("Only truecolor images can be loaded");
+	}
+	m_width = gdImageSX(m_image);
+	m_height = gdImageSY(m_image);
+}
+
 Image::~Image()
 {
 	gdImageDestroy(m_image);
@@ -103,6 +124,13 @@ void Image::drawCircle(int x, int y, int diameter, const Color &c)
 	gdImageArc(m_image, x, y, diameter, diameter, 0, 360, color2int(c));
 }
 
+void Image::copyRect(const Image &src, int x, int y, int w, int h)
+{
+	SIZECHECK(x, y);
+	SIZECHECK(x + w - 1, y + h - 1);
+	gdImageCopy(m_image, src.m_image, x, y, x, y, w, h);
+}
+
 void Image::save(const std::string &filename)
 {
 #if (GD_MAJOR_VERSION == 2 && GD_MINOR_VERSION == 1 && GD_RELEASE_VERSION >= 1) || (GD_MAJOR_VERSION == 2 && GD_MINOR_VERSION > 1) || GD_MAJOR_VERSION > 2
@@ -124,3 +152,27 @@ void Image::save(const std::string &filename)
 	fclose(f);
 #endif
 }
+
+std::string Image::encodePNG()
+{
+	int size = 0;
+	void *data = gdImagePngPtr(m_image, &size);
+	if (!data)
+		throw std::runtime_error("Error encoding image");
+	std::string png(static_cast<const char*>(data), size);
+	gdFree(data);
+	return png;
+}
+
+void Image::copyToRGBA(u8 *buffer)
+{
+	for (int y = 0; y < m_height; y++) {
+		for (int x = 0; x < m_width; x++) {
+			Color c = int2color(m_image->tpixels[y][x]);
+			*buffer++ = c.r;
+			*buffer++ = c.g;
+			*buffer++ = c.b;
+			*buffer++ = c.a;
+		}
+	}
+}
@@ -0,0 +1,99 @@
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "MapRenderer.h"
+#include "TileGenerator.h"
+#include "Image.h"
+
+struct MapRenderer::Impl {
+	TileGenerator generator;
+
+	std::mutex mutex; // for the rest
+	std::set<std::string> unknownNodes;
+};
+
+static RenderJob makeJob(const MapRenderOptions &options)
+{
+	RenderJob job;
+	if (options.w > 0 || options.h > 0) {
+		if (options.w < 1 || options.h < 1)
+			throw std::runtime_error("Invalid area");
+		job.x = options.x;
+		job.y = options.z;
+		job.w = options.w;
+		job.h = options.h;
+	}
+	if (options.zoom < 1)
+		throw std::runtime_error("Zoom level needs to be a number: 1 or higher");
+	job.zoom = options.zoom;
+	job.minY = options.minY;
+	job.maxY = options.maxY;
+	job.drawAlpha = options.drawAlpha;
+	job.drawScale = options.drawScale;
+	job.drawOrigin = options.drawOrigin;
+	job.noShading = !options.shading;
+	return job;
+}
+
+MapRenderer::MapRenderer(const std::string &worldPath, const std::string &colorsPath,
+	const std::string &backend) :
+	m_impl(new Impl())
+{
+	TileGenerator &generator = m_impl->generator;
+	generator.parseColorsFile(colorsPath);
+	generator.setBackend(backend);
+	generator.openWorld(worldPath, std::thread::hardware_concurrency());
+}
+
+MapRenderer::~MapRenderer()
+{
+}
+
+bool MapRenderer::getExtent(const MapRenderOptions &options,
+	int &x, int &z, int &w, int &h)
+{
+	return m_impl->generator.getExtent(makeJob(options), x, z, w, h);
+}
+
+void MapRenderer::getImageSize(const MapRenderOptions &options, int &width, int &height)
+{
+	m_impl->generator.getImageSize(makeJob(options), width, height);
+}
+
+void MapRenderer::renderRGBA(const MapRenderOptions &options, uint8_t *buffer,
+	int width, int height)
+{
+	std::set<std::string> unknownNodes;
+	m_impl->generator.renderJob(makeJob(options), [&] (Image &image) {
+		if (image.getWidth() != width || image.getHeight() != height) {
+			throw std::runtime_error("The image is " +
+				std::to_string(image.getWidth()) + "x" +
+				std::to_string(image.getHeight()) + ", not " +
+				std::to_string(width) + "x" + std::to_string(height));
+		}
+		image.copyToRGBA(buffer);
+	}, unknownNodes);
+
+	std::lock_guard<std::mutex> lock(m_impl->mutex);
+	m_impl->unknownNodes.insert(unknownNodes.begin(), unknownNodes.end());
+}
+
+std::string MapRenderer::renderPNG(const MapRenderOptions &options)
+{
+	std::string png;
+	std::set<std::string> unknownNodes;
+	m_impl->generator.renderJob(makeJob(options), [&] (Image &image) {
+		png = image.encodePNG();
+	}, unknownNodes);
+
+	std::lock_guard<std::mutex> lock(m_impl->mutex);
+	m_impl->unknownNodes.insert(unknownNodes.begin(), unknownNodes.end());
+	return png;
+}
+
+std::set<std::string> MapRenderer::getUnknownNodes()
+{
+	std::lock_guard<std::mutex> lock(m_impl->mutex);
+	return m_impl->unknownNodes;
+}
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "PositionIndex.h"
+
+// packs a position into an integer that sorts by (z, x, y)
+static inline uint64_t pack(int16_t z, int16_t x, int16_t y)
+{
+	return (uint64_t) (uint16_t) (z + 32768) << 32 |
+		(uint64_t) (uint16_t) (x + 32768) << 16 |
+		(uint16_t) (y + 32768);
+}
+
+static inline int16_t unpack(uint64_t v, int shift)
+{
+	return (int) ((v >> shift) & 0xffff) - 32768;
+}
+
+void PositionIndex::clear()
+{
+	m_columns.clear();
+	m_ys.clear();
+	m_pending.clear();
+}
+
+void PositionIndex::add(BlockPos pos)
+{
+	m_pending.push_back(pack(pos.z, pos.x, pos.y));
+}
+
+void PositionIndex::finalize()
+{
+	if (m_pending.empty())
+		return;
+
+	// merge with what we already have
+	m_pending.reserve(m_pending.size() + m_ys.size());
+	for (size_t i = 0; i + 1 < m_columns.size(); i++) {
+		const Column &col = m_columns[i];
+		for (uint32_t j = col.offset; j < m_columns[i + 1].offset; j++)
+			m_pending.push_back(pack(col.z, col.x, m_ys[j]));
+	}
+	std::sort(m_pending.begin(), m_pending.end());
+	m_pending.erase(std::unique(m_pending.begin(), m_pending.end()), m_pending.end());
+
+	m_columns.clear();
+	m_ys.clear();
+	m_ys.reserve(m_pending.size());
+	uint64_t last = UINT64_MAX;
+	for (uint64_t v : m_pending) {
+		if ((v >> 16) != last) {
+			last = v >> 16;
+			m_columns.push_back(Column{unpack(v, 32), unpack(v, 16),
+				static_cast<uint32_t>(m_ys.size())});
+		}
+		m_ys.push_back(unpack(v, 0));
+	}
+	m_columns.push_back(Column{INT16_MAX, INT16_MAX, static_cast<uint32_t>(m_ys.size())});
+	m_columns.shrink_to_fit();
+
+	m_pending.clear();
+	m_pending.shrink_to_fit();
+}
+
+size_t PositionIndex::lowerBound(int16_t z, int16_t x) const
+{
+	if (m_columns.empty())
+		return 0;
+	auto it = std::lower_bound(m_columns.begin(), m_columns.end() - 1,
+		std::make_pair(z, x), [] (const Column &c, const std::pair<int16_t, int16_t> &v) {
+			return c.z < v.first || (c.z == v.first && c.x < v.second);
+		});
+	return it - m_columns.begin();
+}
+
+PositionIndex::YRange PositionIndex::column(int16_t x, int16_t z) const
+{
+	size_t i = lowerBound(z, x);
+	if (i + 1 >= m_columns.size() || m_columns[i].z != z || m_columns[i].x != x)
+		return YRange(nullptr, nullptr);
+	const int16_t *base = m_ys.data();
+	return YRange(base + m_columns[i].offset, base + m_columns[i + 1].offset);
+}
+
+template<typename F>
+void PositionIndex::forEach(BlockPos min, BlockPos max, F cb) const
+{
+	for (int z = min.z; z < max.z; z++) {
+		for (size_t i = lowerBound(z, min.x); i + 1 < m_columns.size(); i++) {
+			const Column &col = m_columns[i];
+			if (col.z != z || col.x >= max.x)
+				break;
+			const int16_t *begin = m_ys.data() + col.offset;
+			const int16_t *end = m_ys.data() + m_columns[i + 1].offset;
+			const int16_t *y0 = std::lower_bound(begin, end, min.y);
+			const int16_t *y1 = std::lower_bound(y0, end, max.y);
+			cb(col, y0, y1);
+		}
+	}
+}
+
+void PositionIndex::query(BlockPos min, BlockPos max, std::vector<BlockPos> &positions) const
+{
+	forEach(min, max, [&] (const Column &col, const int16_t *y0, const int16_t *y1) {
+		for (; y0 != y1; y0++)
+			positions.emplace_back(col.x, *y0, col.z);
+	});
+}
+
+size_t PositionIndex::count(BlockPos min, BlockPos max) const
+{
+	size_t n = 0;
+	forEach(min, max, [&] (const Column &, const int16_t *y0, const int16_t *y1) {
+		n += y1 - y0;
+	});
+	return n;
+}
+
+bool PositionIndex::extent(BlockPos min, BlockPos max,
+	BlockPos &emin, BlockPos &emax) const
+{
+	bool found = false;
+	forEach(min, max, [&] (const Column &col, const int16_t *y0, const int16_t *y1) {
+		if (y0 == y1)
+			return;
+		if (!found) {
+			emin = BlockPos(col.x, y0[0], col.z);
+			emax = BlockPos(col.x, y1[-1], col.z);
+			found = true;
+			return;
+		}
+		emin.x = std::min(emin.x, col.x);
+		emin.y = std::min(emin.y, y0[0]);
+		emax.x = std::max(emax.x, col.x);
+		emax.y = std::max(emax.y, y1[-1]);
+		emax.z = col.z; // columns come sorted by Z
+	});
+	return found;
+}
+
+/* File format (native byte order, everything 8-byte aligned so the arrays
+ * could be mapped into memory directly):
+ *   char[8]  magic
+ *   uint32   byte order mark
+ *   uint32   tag length, followed by tag padded to 8 bytes
+ *   uint64   number of columns (including the sentinel, if there are any)
+ *   uint64   number of Y values
+ *   Column[] columns
+ *   int16[]  Y values
+ */
+static const char indexMagic[8] = {'M', 'T', 'M', 'P', 'I', 'D', 'X', '1'};
+static const uint32_t indexBOM = 0x01020304;
+
+void PositionIndex::save(const std::string &path, const std::string &tag) const
+{
+	static_assert(sizeof(Column) == 8, "unexpected padding");
+	const std::string tmp = path + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (!f)
+		throw std::runtime_error("Failed to write position index");
+
+	const char pad[8] = {0};
+	uint32_t tagLen = tag.size();
+	uint64_t counts[2] = { m_columns.size(), m_ys.size() };
+	bool ok = fwrite(indexMagic, sizeof(indexMagic), 1, f) == 1 &&
+		fwrite(&indexBOM, sizeof(indexBOM), 1, f) == 1 &&
+		fwrite(&tagLen, sizeof(tagLen), 1, f) == 1 &&
+		fwrite(tag.data(), 1, tagLen, f) == tagLen &&
+		fwrite(pad, 1, (8 - tagLen % 8) % 8, f) == (8 - tagLen % 8) % 8 &&
+		fwrite(counts, sizeof(counts), 1, f) == 1 &&
+		fwrite(m_columns.data(), sizeof(Column), m_columns.size(), f) == m_columns.size() &&
+		fwrite(m_ys.data(), sizeof(int16_t), m_ys.size(), f) == m_ys.size();
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+		remove(tmp.c_str());
+		throw std::runtime_error("Failed to write position index");
+	}
+}
+
+// whether a loaded index can be used without reading out of bounds
+bool PositionIndex::valid() const
+{
+	// an empty world has no columns, not even the sentinel
+	if (m_columns.empty())
+		return m_ys.empty();
+	if (m_columns.front().offset != 0 ||
+		m_columns.back().offset != m_ys.size())
+		return false;
+	for (size_t i = 0; i + 1 < m_columns.size(); i++) {
+		const Column &col = m_columns[i], &next = m_columns[i + 1];
+		if (next.offset < col.offset)
+			return false;
+		if (i + 2 < m_columns.size() &&
+			(next.z < col.z || (next.z == col.z && next.x <= col.x)))
+			return false;
+		for (uint32_t j = col.offset + 1; j < next.offset; j++) {
+			if (m_ys[j] <= m_ys[j - 1])
+				return false;
+		}
+	}
+	return true;
+}
+
+bool PositionIndex::load(const std::string &path, const std::string &tag)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f)
+		return false;
+
+	char magic[8];
+	uint32_t bom, tagLen;
+	uint64_t counts[2];
+	std::string tag2;
+	bool ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+		!memcmp(magic, indexMagic, sizeof(magic)) &&
+		fread(&bom, sizeof(bom), 1, f) == 1 && bom == indexBOM &&
+		fread(&tagLen, sizeof(tagLen), 1, f) == 1 && tagLen == tag.size();
+	if (ok) {
+		tag2.resize(tagLen + (8 - tagLen % 8) % 8);
+		ok = fread(&tag2[0], 1, tag2.size(), f) == tag2.size() &&
+			tag2.compare(0, tagLen, tag) == 0 &&
+			fread(counts, sizeof(counts), 1, f) == 1 &&
+			counts[0] <= UINT32_MAX && counts[1] <= UINT32_MAX;
+	}
+	if (ok) {
+		clear();
+		m_columns.resize(counts[0]);
+		m_ys.resize(counts[1]);
+		ok = fread(m_columns.data(), sizeof(Column), m_columns.size(), f) == m_columns.size() &&
+			fread(m_ys.data(), sizeof(int16_t), m_ys.size(), f) == m_ys.size() &&
+			valid();
+		if (!ok)
+			clear();
+	}
+	fclose(f);
+	return ok;
+}
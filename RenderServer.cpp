@@ -0,0 +1,237 @@
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#ifndef _WIN32
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+#include "RenderServer.h"
+
+// requests are short lines of text
+#define MAX_REQUEST_SIZE (64 * 1024)
+// more clients wait in the listen backlog until a connection is closed
+#define MAX_CONNECTIONS 64
+
+#ifndef _WIN32
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SO_NOSIGPIPE is set on the socket instead
+#endif
+
+/* The signal can be delivered to any thread, so the handler wakes up the
+ * accepting thread through a pipe, which also tells it when a connection
+ * was closed. */
+static int wakeFd = -1;
+
+static void onStopSignal(int)
+{
+	const char c = 's';
+	if (write(wakeFd, &c, 1) < 0) {
+		// full, it will wake up anyway
+	}
+}
+
+static bool readFull(int fd, void *buf, size_t size)
+{
+	char *p = static_cast<char*>(buf);
+	while (size > 0) {
+		ssize_t n = read(fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool writeFull(int fd, const void *buf, size_t size)
+{
+	const char *p = static_cast<const char*>(buf);
+	while (size > 0) {
+		// a client that went away must not kill the server with SIGPIPE
+		ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+
+RenderServer::RenderServer(const std::string &path) :
+	m_path(path)
+{
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("Socket path is too long");
+	strcpy(addr.sun_path, path.c_str());
+
+	// a previous server may have left its socket behind
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path.c_str());
+
+	if (pipe(m_wake) != 0)
+		throw std::runtime_error("Failed to create pipe");
+	for (int fd : m_wake) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_fd == -1) {
+		close(m_wake[0]);
+		close(m_wake[1]);
+		throw std::runtime_error("Failed to create socket");
+	}
+	if (bind(m_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+		listen(m_fd, 16) != 0) {
+		std::string err = strerror(errno);
+		close(m_fd);
+		close(m_wake[0]);
+		close(m_wake[1]);
+		throw std::runtime_error("Failed to listen on socket: " + err);
+	}
+}
+
+
+RenderServer::~RenderServer()
+{
+	close(m_fd);
+	close(m_wake[0]);
+	close(m_wake[1]);
+	unlink(m_path.c_str());
+}
+
+
+void RenderServer::run(const Handler &handler)
+{
+	wakeFd = m_wake[1];
+	struct sigaction sa = {};
+	sa.sa_handler = onStopSignal;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	bool stop = false;
+	while (!stop) {
+		size_t connections;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			connections = m_connections.size();
+		}
+		struct pollfd fds[2] = {
+			{ m_wake[0], POLLIN, 0 },
+			{ m_fd, POLLIN, 0 },
+		};
+		// only accept when there is room for another connection
+		if (poll(fds, connections < MAX_CONNECTIONS ? 2 : 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error(std::string("Failed to wait for connections: ") +
+				strerror(errno));
+		}
+
+		if (fds[0].revents & POLLIN) {
+			char buf[64];
+			ssize_t n;
+			while ((n = read(m_wake[0], buf, sizeof(buf))) > 0)
+				stop |= memchr(buf, 's', n) != nullptr;
+		}
+		if (stop || !(fds[1].revents & POLLIN))
+			continue;
+
+		int fd = accept(m_fd, nullptr, nullptr);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			throw std::runtime_error(std::string("Failed to accept connection: ") +
+				strerror(errno));
+		}
+#ifdef SO_NOSIGPIPE
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_connections.insert(fd);
+		std::thread(&RenderServer::serveConnection, this, fd, std::cref(handler)).detach();
+	}
+
+	// let the connections finish what they're doing
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (int fd : m_connections)
+		shutdown(fd, SHUT_RD);
+	m_done.wait(lock, [this] () { return m_connections.empty(); });
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	wakeFd = -1;
+}
+
+
+void RenderServer::serveConnection(int fd, const Handler &handler)
+{
+	std::string request;
+	uint8_t hdr[4];
+	while (readFull(fd, hdr, sizeof(hdr))) {
+		uint32_t size = hdr[0] | hdr[1] << 8 | hdr[2] << 16 | (uint32_t) hdr[3] << 24;
+		if (size > MAX_REQUEST_SIZE)
+			break;
+		request.resize(size);
+		if (!readFull(fd, &request[0], size))
+			break;
+
+		const std::string response = handler(request);
+		size = response.size();
+		for (int i = 0; i < 4; i++)
+			hdr[i] = size >> (8 * i);
+		if (!writeFull(fd, hdr, sizeof(hdr)) ||
+			!writeFull(fd, response.data(), response.size()))
+			break;
+	}
+
+	// fd can't be given out again before it's erased
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_connections.erase(fd);
+	close(fd);
+	m_done.notify_all();
+	// there may be room for a waiting client now
+	const char c = 'c';
+	if (write(m_wake[1], &c, 1) < 0) {
+		// full, the accepting thread wakes up anyway
+	}
+}
+
+#else
+
+RenderServer::RenderServer(const std::string &path) :
+	m_path(path), m_fd(-1), m_wake{-1, -1}
+{
+	throw std::runtime_error("The render server is not supported on Windows");
+}
+
+RenderServer::~RenderServer()
+{
+}
+
+void RenderServer::run(const Handler &handler)
+{
+}
+
+void RenderServer::serveConnection(int fd, const Handler &handler)
+{
+}
+
+#endif
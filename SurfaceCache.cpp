@@ -0,0 +1,152 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "SurfaceCache.h"
+
+static const char cacheMagic[8] = {'M', 'T', 'M', 'P', 'S', 'R', 'F', '1'};
+static const uint32_t cacheBOM = 0x01020304;
+
+static_assert(sizeof(SurfacePixel) == 14, "unexpected padding");
+static_assert(sizeof(SurfaceCacheInfo) == 32, "unexpected padding");
+
+struct SurfaceCacheHeader {
+	char magic[8];
+	uint32_t bom;
+	uint32_t rows;
+	SurfaceCacheInfo info;
+	uint64_t namesOffset;
+};
+
+SurfaceCacheWriter::SurfaceCacheWriter(const std::string &path,
+		const SurfaceCacheInfo &info) :
+	m_path(path), m_info(info), m_offset(0), m_rows(0)
+{
+	m_width = (info.xMax - info.xMin + 1) * 16;
+	m_names.emplace_back(); // ID 0
+
+	m_file = fopen((m_path + ".tmp").c_str(), "wb");
+	if (!m_file)
+		throw std::runtime_error("Failed to write surface cache");
+	SurfaceCacheHeader hdr = {};
+	write(&hdr, sizeof(hdr)); // filled in at the end
+}
+
+SurfaceCacheWriter::~SurfaceCacheWriter()
+{
+	if (m_file) {
+		fclose(m_file);
+		remove((m_path + ".tmp").c_str());
+	}
+}
+
+void SurfaceCacheWriter::write(const void *data, size_t size)
+{
+	if (fwrite(data, 1, size, m_file) != size)
+		throw std::runtime_error("Failed to write surface cache");
+	m_offset += size;
+}
+
+uint16_t SurfaceCacheWriter::intern(const std::string &name)
+{
+	auto it = m_ids.find(name);
+	if (it != m_ids.end())
+		return it->second;
+	if (m_names.size() > UINT16_MAX)
+		throw std::runtime_error("Too many different nodes for the surface cache");
+	uint16_t id = m_names.size();
+	m_names.push_back(name);
+	m_ids[name] = id;
+	return id;
+}
+
+void SurfaceCacheWriter::writeRow(int16_t z, const SurfacePixel *pixels)
+{
+	write(&z, sizeof(z));
+	write(pixels, 16 * m_width * sizeof(SurfacePixel));
+	m_rows++;
+}
+
+void SurfaceCacheWriter::finish()
+{
+	SurfaceCacheHeader hdr;
+	memcpy(hdr.magic, cacheMagic, sizeof(hdr.magic));
+	hdr.bom = cacheBOM;
+	hdr.rows = m_rows;
+	hdr.info = m_info;
+	hdr.namesOffset = m_offset;
+
+	uint32_t count = m_names.size();
+	write(&count, sizeof(count));
+	for (const auto &name : m_names) {
+		uint16_t len = name.size();
+		write(&len, sizeof(len));
+		write(name.data(), len);
+	}
+
+	bool ok = fseek(m_file, 0, SEEK_SET) == 0 &&
+		fwrite(&hdr, sizeof(hdr), 1, m_file) == 1;
+	ok = fclose(m_file) == 0 && ok;
+	m_file = nullptr;
+	const std::string tmp = m_path + ".tmp";
+	if (!ok || rename(tmp.c_str(), m_path.c_str()) != 0) {
+		remove(tmp.c_str());
+		throw std::runtime_error("Failed to write surface cache");
+	}
+}
+
+
+SurfaceCacheReader::SurfaceCacheReader(const std::string &path) :
+	m_rowsRead(0)
+{
+	m_file = fopen(path.c_str(), "rb");
+	if (!m_file)
+		throw std::runtime_error("Failed to open surface cache");
+
+	SurfaceCacheHeader hdr;
+	bool ok = fread(&hdr, sizeof(hdr), 1, m_file) == 1 &&
+		!memcmp(hdr.magic, cacheMagic, sizeof(hdr.magic)) &&
+		hdr.bom == cacheBOM &&
+		hdr.info.xMin <= hdr.info.xMax && hdr.info.zMin <= hdr.info.zMax &&
+		hdr.info.xMax - hdr.info.xMin < 4096 &&
+		hdr.info.zMax - hdr.info.zMin < 4096 &&
+		fseek(m_file, hdr.namesOffset, SEEK_SET) == 0;
+	uint32_t count = 0;
+	ok = ok && fread(&count, sizeof(count), 1, m_file) == 1 &&
+		count > 0 && count <= UINT16_MAX + 1;
+	for (uint32_t i = 0; ok && i < count; i++) {
+		uint16_t len;
+		std::string name;
+		ok = fread(&len, sizeof(len), 1, m_file) == 1;
+		if (ok) {
+			name.resize(len);
+			ok = fread(&name[0], 1, len, m_file) == len;
+		}
+		m_names.push_back(name);
+	}
+	ok = ok && fseek(m_file, sizeof(hdr), SEEK_SET) == 0;
+	if (!ok) {
+		fclose(m_file);
+		throw std::runtime_error("Not a valid surface cache file");
+	}
+
+	m_info = hdr.info;
+	m_width = (m_info.xMax - m_info.xMin + 1) * 16;
+	m_rows = hdr.rows;
+}
+
+SurfaceCacheReader::~SurfaceCacheReader()
+{
+	fclose(m_file);
+}
+
+bool SurfaceCacheReader::readRow(int16_t &z, std::vector<SurfacePixel> &pixels)
+{
+	if (m_rowsRead == m_rows)
+		return false;
+	pixels.resize(16 * m_width);
+	if (fread(&z, sizeof(z), 1, m_file) != 1 ||
+		fread(pixels.data(), sizeof(SurfacePixel), pixels.size(), m_file) != pixels.size())
+		throw std::runtime_error("Surface cache is truncated");
+	m_rowsRead++;
+	return true;
+}
@@ -3,22 +3,40 @@
 #include <climits>
 #include <cassert>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <cstring>
+#include <cerrno>
 #include <vector>
-#include <type_traits>
-#include <limits>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 #include "TileGenerator.h"
 #include "config.h"
 #include "PlayerAttributes.h"
 #include "BlockDecoder.h"
+#include "BlockCache.h"
+#include "RenderServer.h"
+#include "SurfaceCache.h"
 #include "Image.h"
 #include "util.h"
 
 #include "db-sqlite3.h"
+#include "db-snapshot.h"
+#include "db-stream.h"
+#include "db-shared.h"
 #if USE_POSTGRESQL
 #include "db-postgresql.h"
 #endif
@@ -29,45 +47,41 @@
 #include "db-redis.h"
 #endif
 
-#ifndef __has_builtin
-#define __has_builtin(x) 0
+#if !defined(_WIN32) && !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0 // SO_NOSIGPIPE is set on the socket instead
 #endif
 
-// saturating multiplication
-template<typename T, class = typename std::enable_if<std::is_unsigned<T>::value>::type>
-inline T sat_mul(T a, T b)
-{
-#if __has_builtin(__builtin_mul_overflow)
-	T res;
-	if (__builtin_mul_overflow(a, b, &res))
-		return std::numeric_limits<T>::max();
-	return res;
-#else
-	// WARNING: the fallback implementation is incorrect since we compute ceil(log(x)) not log(x)
-	// but that's good enough for our usecase...
-	const int bits = sizeof(T) * 8;
-	int hb_a = 0, hb_b = 0;
-	for (int i = bits - 1; i >= 0; i--) {
-		if (a & (static_cast<T>(1) << i)) {
-			hb_a = i; break;
-		}
-	}
-	for (int i = bits - 1; i >= 0; i--) {
-		if (b & (static_cast<T>(1) << i)) {
-			hb_b = i; break;
-		}
-	}
-	// log2(a) + log2(b) >= log2(MAX) <=> calculation will overflow
-	if (hb_a + hb_b >= bits)
-		return std::numeric_limits<T>::max();
-	return a * b;
-#endif
-}
+// how much block data renders that share a database keep in memory
+#define COLUMN_CACHE_SIZE (256 * 1024 * 1024)
+// how often requests look for changes to the map (seconds), and how often
+// they do so thoroughly when the backend has a cheaper way to tell
+#define CHANGE_CHECK_INTERVAL 1
+#define CHANGE_FULL_CHECK_INTERVAL 60
+// limits on how much work the traversal planner may do while sampling
+#define PLAN_MAX_LOOKUPS 1024
+#define PLAN_MAX_TIME 0.1
+
+/* What the renders of a world opened by openWorld() have in common.
+ * The caches are dropped between renders when the map has changed.
+ */
+struct SharedWorld {
+	std::string inputPath;
+	DBShared *db;
+	bool fixed; // the map can't change
+	std::string token, hint; // of the map the caches hold
+
+	std::mutex mutex; // for the rest
+	std::condition_variable cv;
+	unsigned int threads, rendering;
+	bool checking, dropping;
+	std::chrono::steady_clock::time_point nextCheck, nextFullCheck;
+};
 
-template<typename T>
-inline T sat_mul(T a, T b, T c)
+static inline int16_t mod16(int16_t y)
 {
-	return sat_mul(sat_mul(a, b), c);
+	if (y < 0)
+		return (y - 15) / 16;
+	return y / 16;
 }
 
 // rounds n (away from 0) to a multiple of f while preserving the sign of n
@@ -126,11 +140,16 @@ TileGenerator::TileGenerator():
 	m_drawAlpha(false),
 	m_shading(true),
 	m_dontWriteEmpty(false),
+	m_incremental(false),
 	m_backend(""),
 	m_xBorder(0),
 	m_yBorder(0),
 	m_db(NULL),
+	m_dbShared(false),
 	m_image(NULL),
+	m_surfaceCache(NULL),
+	m_blockCacheSize(256 * 1024 * 1024),
+	m_timingsJson(false),
 	m_xMin(INT_MAX),
 	m_xMax(INT_MIN),
 	m_zMin(INT_MAX),
@@ -145,14 +164,21 @@ TileGenerator::TileGenerator():
 	m_renderedAny(false),
 	m_zoom(1),
 	m_scales(SCALE_LEFT | SCALE_TOP),
+	m_showProgress(true),
 	m_progressMax(0),
-	m_progressLast(-1)
+	m_progressLast(-1),
+	m_progressFd(-1),
+	m_progressInterval(1),
+	m_progressBlocks(0),
+	m_progressBytes(0),
+	m_progressRow(0)
 {
 }
 
 TileGenerator::~TileGenerator()
 {
 	closeDatabase();
+	delete m_surfaceCache;
 }
 
 void TileGenerator::setBgColor(const std::string &bgColor)
@@ -217,6 +243,11 @@ void TileGenerator::setBackend(std::string backend)
 	m_backend = backend;
 }
 
+void TileGenerator::setBackendOption(const std::string &name, const std::string &value)
+{
+	m_backendOptions[name] = value;
+}
+
 void TileGenerator::setGeometry(int x, int y, int w, int h)
 {
 	assert(w > 0 && h > 0);
@@ -250,6 +281,45 @@ void TileGenerator::setDontWriteEmpty(bool f)
 	m_dontWriteEmpty = f;
 }
 
+void TileGenerator::setSurfaceCache(const std::string &path)
+{
+	m_surfaceCachePath = path;
+}
+
+void TileGenerator::setBlockCacheSize(int megabytes)
+{
+	m_blockCacheSize = (size_t) megabytes * 1024 * 1024;
+}
+
+void TileGenerator::setTimings(bool json)
+{
+	m_timings = std::make_shared<Timings>();
+	m_timingsJson = json;
+}
+
+void TileGenerator::setTrace(const std::string &path)
+{
+	m_trace = std::make_shared<Trace>(path);
+	m_trace->setThreadName("main");
+}
+
+void TileGenerator::setProgressFd(int fd, double interval)
+{
+	m_progressFd = fd;
+	m_progressInterval = interval;
+#ifdef SO_NOSIGPIPE
+	// fails harmlessly if it's not a socket
+	int one = 1;
+	if (fd >= 0)
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+void TileGenerator::setIncremental(bool f)
+{
+	m_incremental = f;
+}
+
 void TileGenerator::parseColorsFile(const std::string &fileName)
 {
 	std::ifstream in(fileName);
@@ -262,7 +332,7 @@ void TileGenerator::printGeometry(const std::string &input_path)
 {
 	setExhaustiveSearch(EXH_NEVER);
 	openDb(input_path);
-	loadBlocks();
+	loadExtent();
 
 	std::cout << "Map extent: "
 		<< m_xMin*16 << ":" << m_zMin*16
@@ -291,11 +361,83 @@ void TileGenerator::dumpBlock(const std::string &input_path, BlockPos pos)
 	closeDatabase();
 }
 
+void TileGenerator::exportSnapshot(const std::string &input_path, const std::string &output)
+{
+	openDb(input_path);
+
+	const int16_t yMax = mod16(m_yMax) + 1;
+	const int16_t yMin = mod16(m_yMin);
+	m_db->visitBlockPos(
+		BlockPos(m_geomX, yMin, m_geomY),
+		BlockPos(m_geomX2, yMax, m_geomY2),
+		[&] (BlockPos pos) {
+			m_positions.add(pos.x, pos.z);
+		}
+	);
+	m_positions.finalize();
+
+	SnapshotWriter writer(output);
+	m_positions.forEachReverse([&] (int16_t x, int16_t z) {
+		writer.addColumn(x, z);
+		m_db->visitBlocksOnXZ(x, z, yMin, yMax,
+			[&] (BlockPos pos, const u8 *data, size_t size) {
+				writer.addBlock(pos.y, data, size);
+				return true;
+			});
+	}, [] (int16_t) {});
+	writer.finish();
+#ifndef NDEBUG
+	std::cerr << "Exported " << writer.blockCount() << " blocks in "
+		<< m_positions.size() << " columns" << std::endl;
+#endif
+
+	closeDatabase();
+}
+
 void TileGenerator::generate(const std::string &input_path, const std::string &output)
 {
 	if (m_dontWriteEmpty) // FIXME: possible too, just needs to be done differently
 		setExhaustiveSearch(EXH_NEVER);
+	if (m_drawPlayers && (m_backend == "snapshot" || m_backend == "stream")) {
+		std::cerr << "Note: The " << m_backend << " backend does not "
+			"contain players, not drawing any." << std::endl;
+		m_drawPlayers = false;
+	}
 	openDb(input_path);
+	planTraversal();
+	renderOutput(input_path, output);
+	printUnknown();
+	printTimings();
+	writeTrace();
+}
+
+/* Renders the map with the database opened by the caller, which is closed
+ * as soon as it's no longer needed.
+ */
+void TileGenerator::renderOutput(const std::string &input_path, const std::string &output)
+{
+	m_progressOutput = output;
+	std::string changeToken;
+	if (m_incremental) {
+		changeToken = m_db->getChangeToken();
+		if (changeToken.empty()) {
+			std::cerr << "Warning: The current database backend does not support "
+				"incremental rendering, rendering everything." << std::endl;
+		} else if (m_drawPlayers) {
+			std::cerr << "Note: Incremental rendering is not possible while "
+				"drawing players, rendering everything." << std::endl;
+			changeToken.clear();
+		} else if (!m_surfaceCachePath.empty()) {
+			std::cerr << "Note: Incremental rendering is not possible while "
+				"saving a surface cache, rendering everything." << std::endl;
+			changeToken.clear();
+		} else if (renderIncremental(output)) {
+			closeDatabase();
+			writeState(output, changeToken);
+			return;
+		}
+	}
+
 	loadBlocks();
 
 	if (m_dontWriteEmpty && m_positions.empty())
@@ -305,8 +447,471 @@ void TileGenerator::generate(const std::string &input_path, const std::string &o
 	}
 
 	createImage();
+	if (!m_surfaceCachePath.empty()) {
+		SurfaceCacheInfo info = {};
+		info.xMin = m_xMin;
+		info.xMax = m_xMax;
+		info.zMin = m_zMin;
+		info.zMax = m_zMax;
+		info.yMin = m_yMin;
+		info.yMax = m_yMax;
+		info.flags = m_drawAlpha ? SURFACE_ALPHA : 0;
+		m_surfaceCache = new SurfaceCacheWriter(m_surfaceCachePath, info);
+		m_surfaceRow.resize(16 * m_mapWidth);
+		for (auto &px : m_surfaceRow)
+			px.reset();
+	}
 	renderMap();
 	closeDatabase();
+	if (m_surfaceCache) {
+		m_surfaceCache->finish();
+		delete m_surfaceCache;
+		m_surfaceCache = NULL;
+		m_surfaceRow.clear();
+		m_surfaceRow.shrink_to_fit();
+	}
+	{
+		Timings::Scope scope(m_timings.get(), Timings::DRAW);
+		Trace::Span span(m_trace.get(), "draw overlays", "render");
+		if (m_drawScale) {
+			renderScale();
+		}
+		if (m_drawOrigin) {
+			renderOrigin();
+		}
+		if (m_drawPlayers) {
+			renderPlayers(input_path);
+		}
+	}
+	writeImage(output);
+	if (!changeToken.empty())
+		writeState(output, changeToken);
+}
+
+bool RenderJob::parse(const std::string &line)
+{
+	std::istringstream iss(line);
+	if (!(iss >> output))
+		return false;
+	auto number = [&] (int &n) {
+		return static_cast<bool>(iss >> n);
+	};
+	std::string opt;
+	while (iss >> opt) {
+		if (opt == "--drawalpha") {
+			drawAlpha = true;
+		} else if (opt == "--drawscale") {
+			drawScale = true;
+		} else if (opt == "--draworigin") {
+			drawOrigin = true;
+		} else if (opt == "--noshading") {
+			noShading = true;
+		} else if (opt == "--geometry") {
+			char c;
+			if (!(iss >> x >> c >> y >> w >> h) || c != ':' || w < 1 || h < 1)
+				return false;
+		} else if (opt == "--zoom") {
+			if (!number(zoom) || zoom < 1)
+				return false;
+		} else if (opt == "--min-y") {
+			if (!number(minY))
+				return false;
+		} else if (opt == "--max-y") {
+			if (!number(maxY))
+				return false;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Wraps the opened database so that copies of this generator can use it
+ * from several threads, with caches for what they have in common.
+ */
+DBShared *TileGenerator::shareDb(bool caches)
+{
+	if (!m_surfaceCachePath.empty())
+		throw std::runtime_error("A surface cache can only be saved by a single render");
+	// columns are what can be shared between renders
+	if (m_dontWriteEmpty || m_exhaustiveSearch == EXH_AUTO) {
+		setExhaustiveSearch(EXH_NEVER);
+		if (m_timings)
+			m_timings->plan("never", "shared");
+	} else if (m_timings) {
+		m_timings->plan(m_exhaustiveSearch == EXH_Y ? "y" :
+			m_exhaustiveSearch == EXH_FULL ? "full" : "never", "given");
+	}
+	if (m_drawPlayers && (m_backend == "snapshot" || m_backend == "stream")) {
+		std::cerr << "Note: The " << m_backend << " backend does not "
+			"contain players, not drawing any." << std::endl;
+		m_drawPlayers = false;
+	}
+	DBShared *db = new DBShared(m_db, caches ? COLUMN_CACHE_SIZE : 0);
+	m_db = db;
+	m_db->setTrace(m_trace.get());
+	if (m_db->streamsBlocks()) {
+		/* Streaming backends keep what the first position or extent query
+		 * covers, so make that everything the renders could ask for.
+		 * (Columns outside of it would be read one block at a time.) */
+		BlockPos emin, emax;
+		m_db->getExtent(BlockPos(-2048), BlockPos(2048), emin, emax);
+	}
+	if (caches && m_blockCacheSize > 0)
+		m_blockCache = std::make_shared<BlockCache>(m_blockCacheSize);
+	m_showProgress = false;
+	return db;
+}
+
+void TileGenerator::applyJob(const RenderJob &job)
+{
+	if (job.w > 0)
+		setGeometry(job.x, job.y, job.w, job.h);
+	if (job.zoom > 0)
+		setZoom(job.zoom);
+	if (job.minY != INT_MIN)
+		setMinY(job.minY);
+	if (job.maxY != INT_MIN)
+		setMaxY(job.maxY);
+	m_drawAlpha |= job.drawAlpha;
+	m_drawScale |= job.drawScale;
+	m_drawOrigin |= job.drawOrigin;
+	m_shading &= !job.noShading;
+}
+
+/* Renders many images from one database. The jobs run in parallel on
+ * copies of this generator that share the database and the caches.
+ */
+void TileGenerator::generateJobs(const std::string &input_path,
+	const std::vector<RenderJob> &jobs, unsigned int threads)
+{
+	openDb(input_path);
+	shareDb(true);
+
+	// nothing was rendered yet, so copies of it don't share any buffers
+	TileGenerator base(*this);
+	base.m_dbShared = true;
+
+	std::atomic<size_t> next(0);
+	std::mutex mutex; // for the rest
+	size_t failed = 0;
+	auto worker = [&] (unsigned int n) {
+		if (m_trace && n > 0)
+			m_trace->setThreadName("worker " + std::to_string(n));
+		for (size_t i; (i = next++) < jobs.size(); ) {
+			const RenderJob &job = jobs[i];
+			Trace::Span span(m_trace.get(), "job", "render");
+			if (span.active())
+				span.setArgs("\"output\":" + Trace::quote(job.output));
+			try {
+				TileGenerator gen(base);
+				if (m_timings)
+					gen.m_timings = std::make_shared<Timings>(); // of this thread
+				gen.applyJob(job);
+				gen.renderOutput(input_path, job.output);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				m_unknownNodes.insert(gen.m_unknownNodes.begin(), gen.m_unknownNodes.end());
+				m_renderedAny |= gen.m_renderedAny;
+				if (m_timings)
+					m_timings->merge(*gen.m_timings);
+				std::cout << "[" << (i + 1) << "/" << jobs.size() << "] "
+					<< job.output << std::endl;
+			} catch (const std::exception &e) {
+				std::lock_guard<std::mutex> lock(mutex);
+				std::cerr << "Failed to render " << job.output << ": "
+					<< e.what() << std::endl;
+				failed++;
+			}
+		}
+	};
+
+	threads = mymax<size_t>(mymin<size_t>(threads, jobs.size()), 1);
+	std::vector<std::thread> workers;
+	for (unsigned int i = 1; i < threads; i++)
+		workers.emplace_back(worker, i);
+	worker(0);
+	for (auto &t : workers)
+		t.join();
+	if (m_timings) {
+		m_timings->skip(); // the jobs counted their own
+		if (m_blockCache) {
+			BlockCache::Stats stats = m_blockCache->getStats();
+			m_timings->count(Timings::CACHE_HITS, stats.hits);
+			m_timings->count(Timings::CACHE_MISSES, stats.misses);
+			m_timings->count(Timings::CACHE_EVICTIONS, stats.evictions);
+		}
+	}
+
+	closeDatabase();
+#ifndef NDEBUG
+	if (m_blockCache) {
+		BlockCache::Stats stats = m_blockCache->getStats();
+		std::cerr << "Block cache: " << stats.blocks << " blocks in "
+			<< (stats.memory / 1024) << " KiB" << std::endl;
+	}
+#endif
+	printUnknown();
+	printTimings();
+	writeTrace();
+	if (failed > 0) {
+		throw std::runtime_error(std::to_string(failed) + " of " +
+			std::to_string(jobs.size()) + " jobs failed");
+	}
+}
+
+/* Renders images on request until stopped, see RenderServer for the
+ * framing. A request is a job line, where the output "-" asks for the PNG
+ * to be sent back. The answer is "OK\n" followed by the PNG, if any, or
+ * "ERROR <message>\n".
+ */
+void TileGenerator::serve(const std::string &input_path, const std::string &socketPath,
+	unsigned int threads)
+{
+	openWorld(input_path, threads);
+
+	RenderServer server(socketPath);
+	std::cout << "Listening on " << socketPath << std::endl;
+
+	std::mutex mutex;
+	std::set<std::string> seen; // unknown nodes
+	server.run([&] (const std::string &request) -> std::string {
+		RenderJob job;
+		if (!job.parse(request))
+			return "ERROR Invalid request\n";
+
+		std::string png;
+		ImageSink sink;
+		if (job.output == "-")
+			sink = [&png] (Image &image) { png = image.encodePNG(); };
+		std::set<std::string> unknownNodes;
+		try {
+			renderJob(job, sink, unknownNodes);
+		} catch (const std::exception &e) {
+			return std::string("ERROR ") + e.what() + "\n";
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const auto &node : unknownNodes) {
+			if (seen.insert(node).second)
+				std::cerr << "Unknown node: " << node << std::endl;
+		}
+		return "OK\n" + png;
+	});
+
+	closeDatabase();
+	writeTrace();
+}
+
+void TileGenerator::openWorld(const std::string &input_path, unsigned int threads)
+{
+	m_world = std::make_shared<SharedWorld>();
+	SharedWorld &world = *m_world;
+	/* The caches have to be dropped when the map changes, which only works
+	 * for backends that tell what changed or that can't change at all. */
+	world.inputPath = input_path;
+	world.fixed = m_backend == "snapshot" || m_backend == "stream";
+	openDb(input_path);
+	if (!world.fixed && m_db->listsBlocksOnce()) {
+		// rendering new blocks' data but not new blocks would be worse
+		std::cerr << "Note: The map backend lists blocks only once, changes "
+			"to the map while serving are not rendered." << std::endl;
+		world.fixed = true;
+	}
+	world.hint = world.fixed ? "" : m_db->getChangeHint();
+	world.token = m_db->getChangeToken();
+	world.db = shareDb(world.fixed || !world.token.empty());
+	world.threads = mymax(threads, 1U);
+	world.rendering = 0;
+	world.checking = world.dropping = false;
+	world.nextCheck = std::chrono::steady_clock::now();
+	world.nextFullCheck = world.nextCheck + std::chrono::seconds(CHANGE_FULL_CHECK_INTERVAL);
+
+	m_incremental = false; // there's no previous image to update
+}
+
+/* Renders the job on a copy of this generator. The image goes to the sink,
+ * or to the output file if there is none.
+ */
+void TileGenerator::renderJob(const RenderJob &job, const ImageSink &sink,
+	std::set<std::string> &unknownNodes) const
+{
+	if (!m_world)
+		throw std::runtime_error("No world was opened");
+	SharedWorld &world = *m_world;
+	{
+		std::unique_lock<std::mutex> lock(world.mutex);
+		world.cv.wait(lock, [&] () {
+			return !world.dropping && world.rendering < world.threads;
+		});
+		/* One request at a time looks for changes, at most once per interval
+		 * and without holding up the others. */
+		auto now = std::chrono::steady_clock::now();
+		if (!world.fixed && !world.checking && now >= world.nextCheck) {
+			world.checking = true;
+			world.nextCheck = now + std::chrono::seconds(CHANGE_CHECK_INTERVAL);
+			lock.unlock();
+			std::string hint, token;
+			bool full = false;
+			try {
+				hint = m_db->getChangeHint();
+				full = hint.empty() || hint != world.hint || now >= world.nextFullCheck;
+				token = full ? m_db->getChangeToken() : world.token;
+			} catch (...) {
+				lock.lock();
+				world.checking = false;
+				throw;
+			}
+			lock.lock();
+			world.checking = false;
+			world.hint = hint;
+			if (full)
+				world.nextFullCheck = now + std::chrono::seconds(CHANGE_FULL_CHECK_INTERVAL);
+			if (token != world.token) {
+				// renders in progress could put old blocks back
+				world.dropping = true;
+				world.cv.wait(lock, [&] () { return world.rendering == 0; });
+				std::vector<BlockPos> changed;
+				bool known = false;
+				try {
+					known = world.db->getChangedBlockPos(world.token, changed);
+				} catch (const std::exception &e) {
+					std::cerr << "Failed to read changes to the map: " << e.what() << std::endl;
+				}
+				if (known) {
+					world.db->dropColumns(changed);
+					if (m_blockCache) {
+						for (auto pos : changed)
+							m_blockCache->erase(pos);
+					}
+				} else {
+					world.db->dropAll();
+					if (m_blockCache)
+						m_blockCache->clear();
+				}
+				world.token = token;
+				world.dropping = false;
+				world.cv.notify_all();
+			}
+			world.cv.wait(lock, [&] () {
+				return !world.dropping && world.rendering < world.threads;
+			});
+		}
+		world.rendering++;
+	}
+
+	struct Finish {
+		SharedWorld &world;
+		~Finish() {
+			std::lock_guard<std::mutex> lock(world.mutex);
+			world.rendering--;
+			world.cv.notify_all();
+		}
+	} finish{world};
+
+	Trace::Span span(m_trace.get(), "job", "render");
+	if (span.active())
+		span.setArgs("\"output\":" + Trace::quote(job.output));
+	TileGenerator gen(*this);
+	gen.m_dbShared = true;
+	gen.m_imageSink = sink;
+	gen.m_timings.reset(); // can't be shared between threads
+	gen.applyJob(job);
+	gen.renderOutput(world.inputPath, job.output);
+	unknownNodes.insert(gen.m_unknownNodes.begin(), gen.m_unknownNodes.end());
+}
+
+bool TileGenerator::getExtent(const RenderJob &job, int &x, int &y, int &w, int &h) const
+{
+	TileGenerator gen(*this);
+	gen.m_dbShared = true;
+	gen.applyJob(job);
+	gen.loadExtent();
+	if (gen.m_xMin > gen.m_xMax)
+		return false;
+	x = gen.m_xMin * 16;
+	y = gen.m_zMin * 16;
+	w = (gen.m_xMax - gen.m_xMin + 1) * 16;
+	h = (gen.m_zMax - gen.m_zMin + 1) * 16;
+	return true;
+}
+
+/* The size the image of the job will have. Without a geometry this depends
+ * on the map, which can change before it is rendered.
+ */
+void TileGenerator::getImageSize(const RenderJob &job, int &width, int &height) const
+{
+	TileGenerator gen(*this);
+	gen.m_dbShared = true;
+	gen.applyJob(job);
+	if (gen.m_geomX <= -2048 || gen.m_geomX2 >= 2048 ||
+		gen.m_geomY <= -2048 || gen.m_geomY2 >= 2048)
+		gen.loadExtent(); // the image is cropped to the map
+	gen.setupImageArea(width, height);
+	if (gen.m_xMin > gen.m_xMax)
+		throw std::runtime_error("The map is empty");
+}
+
+void TileGenerator::generateFromCache(const std::string &cache,
+	const std::string &input_path, const std::string &output)
+{
+	SurfaceCacheReader reader(cache);
+	const SurfaceCacheInfo &info = reader.info();
+	if (m_drawAlpha && !(info.flags & SURFACE_ALPHA))
+		throw std::runtime_error("The surface cache was not saved with --drawalpha");
+	if (m_dontWriteEmpty && reader.rowCount() == 0)
+		return;
+
+	// the area is that of the cache
+	m_geomX = m_geomY = -2048;
+	m_geomX2 = m_geomY2 = 2048;
+	m_xMin = info.xMin;
+	m_xMax = info.xMax;
+	m_zMin = info.zMin;
+	m_zMax = info.zMax;
+	m_yMin = info.yMin;
+	m_yMax = info.yMax;
+
+	std::vector<const ColorEntry*> colors;
+	for (const auto &name : reader.names()) {
+		auto it = m_colorMap.find(name);
+		colors.push_back(it == m_colorMap.end() ? nullptr : &it->second);
+		if (it == m_colorMap.end() && !name.empty())
+			m_unknownNodes.insert(name);
+	}
+
+	createImage();
+	Timings *timings = m_timings.get();
+	int16_t zPos;
+	std::vector<SurfacePixel> pixels;
+	for (;;) {
+		{
+			Timings::Scope scope(timings, Timings::READ);
+			if (!reader.readRow(zPos, pixels))
+				break;
+		}
+		if (zPos < m_zMin || zPos > m_zMax)
+			throw std::runtime_error("Surface cache is corrupt");
+		Trace::Span span(m_trace.get(), "row", "render");
+		if (span.active())
+			span.setArgs("\"z\":" + std::to_string(zPos));
+		{
+			Timings::Scope scope(timings, Timings::RENDER);
+			renderSurfaceRow(zPos, pixels, colors);
+		}
+		if (m_shading) {
+			Timings::Scope scope(timings, Timings::SHADING);
+			renderShading(zPos);
+		}
+	}
+	// the cache can have rows with none of the nodes having a color (anymore)
+	if (m_dontWriteEmpty && !m_renderedAny) {
+		printUnknown();
+		printTimings();
+		writeTrace();
+		return;
+	}
+
 	if (m_drawScale) {
 		renderScale();
 	}
@@ -314,10 +919,87 @@ void TileGenerator::generate(const std::string &input_path, const std::string &o
 		renderOrigin();
 	}
 	if (m_drawPlayers) {
-		renderPlayers(input_path);
+		if (input_path.empty()) {
+			std::cerr << "Note: Players can only be drawn if the world "
+				"is given with -i." << std::endl;
+		} else {
+			renderPlayers(input_path);
+		}
 	}
 	writeImage(output);
 	printUnknown();
+	printTimings();
+	writeTrace();
+}
+
+/* Does what renderMapBlock() and renderMapBlockBottom() did for a row of
+ * pixels again, with the current colors. This is exact as long as there
+ * are no more than two kinds of translucent nodes on top of each other.
+ */
+void TileGenerator::renderSurfaceRow(int16_t zPos, const std::vector<SurfacePixel> &pixels,
+	const std::vector<const ColorEntry*> &colors)
+{
+	auto entry = [&] (uint16_t id) -> const ColorEntry* {
+		return id < colors.size() ? colors[id] : nullptr;
+	};
+
+	const int zBegin = (m_zMax - zPos) * 16;
+	for (int z = 0; z < 16; ++z) {
+		const int imageY = zBegin + z;
+		for (int imageX = 0; imageX < m_mapWidth; ++imageX) {
+			const SurfacePixel &px = pixels[z * m_mapWidth + imageX];
+			if (!px.drawn)
+				continue;
+			auto &attr = m_blockPixelAttributes.attribute(z, imageX);
+
+			if (!m_drawAlpha) {
+				// the first visible node, translucent or not
+				const bool top = px.alphaLayers[0] > 0;
+				const ColorEntry *e = entry(top ? px.alphaNode[0] : px.node);
+				if (!e)
+					continue;
+				Color c = e->toColor();
+				c.a = 255;
+				setZoomed(imageX, imageY, c);
+				attr.height = top ? px.alphaHeight : px.height;
+				m_renderedAny = true;
+				continue;
+			}
+
+			Color color = m_bgColor;
+			color.a = 0;
+			uint8_t thickness = 0;
+			bool opaque = false;
+			auto apply = [&] (const ColorEntry *e) {
+				if (!e || opaque)
+					return;
+				Color c = e->toColor();
+				if (c.a == 0)
+					return;
+				if (color.a != 0)
+					c = mixColors(color, c);
+				if (c.a < 255) {
+					color = c;
+					thickness = (thickness + e->t) / 2;
+					return;
+				}
+				color = c;
+				opaque = true;
+			};
+			for (int run = 0; run < 2; run++) {
+				for (int i = 0; i < px.alphaLayers[run]; i++)
+					apply(entry(px.alphaNode[run]));
+			}
+			apply(entry(px.node));
+
+			setZoomed(imageX, imageY, color);
+			attr.thickness = thickness;
+			if (opaque) {
+				attr.height = px.height;
+				m_renderedAny = true;
+			}
+		}
+	}
 }
 
 void TileGenerator::parseColorsStream(std::istream &in)
@@ -351,6 +1033,8 @@ std::set<std::string> TileGenerator::getSupportedBackends()
 {
 	std::set<std::string> r;
 	r.insert("sqlite3");
+	r.insert("snapshot");
+	r.insert("stream");
 #if USE_POSTGRESQL
 	r.insert("postgresql");
 #endif
@@ -365,6 +1049,8 @@ std::set<std::string> TileGenerator::getSupportedBackends()
 
 void TileGenerator::openDb(const std::string &input_path)
 {
+	Timings::Scope scope(m_timings.get(), Timings::OPEN);
+	Trace::Span span(m_trace.get(), "open map", "render");
 	std::string input = input_path;
 	if (input.back() != PATH_SEPARATOR)
 		input += PATH_SEPARATOR;
@@ -380,6 +1066,10 @@ void TileGenerator::openDb(const std::string &input_path)
 
 	if (backend == "sqlite3")
 		m_db = new DBSQLite3(input);
+	else if (backend == "snapshot")
+		m_db = new DBSnapshot(input_path); // a file, not a world directory
+	else if (backend == "stream")
+		m_db = new DBStream(input_path);
 #if USE_POSTGRESQL
 	else if (backend == "postgresql")
 		m_db = new DBPostgreSQL(input);
@@ -394,89 +1084,359 @@ void TileGenerator::openDb(const std::string &input_path)
 #endif
 	else
 		throw std::runtime_error(std::string("Unknown map backend: ") + backend);
+	m_db->setTrace(m_trace.get());
 
-	// Determine how we're going to traverse the database (heuristic)
-	if (m_exhaustiveSearch == EXH_AUTO) {
-		size_t y_range = (m_yMax / 16 + 1) - (m_yMin / 16);
-		size_t blocks = sat_mul<size_t>(m_geomX2 - m_geomX, y_range, m_geomY2 - m_geomY);
-#ifndef NDEBUG
-		std::cerr << "Heuristic parameters:"
-			<< " preferRangeQueries()=" << m_db->preferRangeQueries()
-			<< " y_range=" << y_range << " blocks=" << blocks << std::endl;
-#endif
-		if (m_db->preferRangeQueries())
-			m_exhaustiveSearch = EXH_NEVER;
-		else if (blocks < 200000)
-			m_exhaustiveSearch = EXH_FULL;
-		else if (y_range < 42)
-			m_exhaustiveSearch = EXH_Y;
-		else
-			m_exhaustiveSearch = EXH_NEVER;
-	} else if (m_exhaustiveSearch == EXH_FULL || m_exhaustiveSearch == EXH_Y) {
+	for (const auto &it : m_backendOptions) {
+		if (!m_db->setOption(it.first, it.second))
+			throw std::runtime_error(std::string("Unknown option for map backend: ") + it.first);
+	}
+
+	if (m_exhaustiveSearch == EXH_FULL || m_exhaustiveSearch == EXH_Y) {
 		if (m_db->preferRangeQueries()) {
 			std::cerr << "Note: The current database backend supports efficient "
 				"range queries, forcing exhaustive search should always result "
 				" in worse performance." << std::endl;
 		}
 	}
-	assert(m_exhaustiveSearch != EXH_AUTO);
 }
 
-void TileGenerator::closeDatabase()
+/* Determine how we're going to traverse the database by trying each way on
+ * a few rows of the map and extrapolating:
+ *   never: list positions, then read every column that has blocks
+ *   y:     list positions, then look up every Y position of those columns
+ *   full:  look up every position of the map
+ * Backends that stream blocks in render order can only be read the first
+ * way, sampling would consume the stream.
+ * The mode applies to the whole map, the render loops and incremental
+ * rendering don't mix them.
+ */
+void TileGenerator::planTraversal()
 {
-	delete m_db;
-	m_db = NULL;
+	static const char *const modeNames[] = {"never", "y", "full"};
+	Timings::Scope scope(m_timings.get(), Timings::PLAN);
+	Trace::Span span(m_trace.get(), "plan traversal", "render");
+	if (m_exhaustiveSearch != EXH_AUTO) {
+		if (m_timings)
+			m_timings->plan(modeNames[m_exhaustiveSearch], "given");
+		return;
+	}
+	if (m_db->streamsBlocks()) {
+		m_exhaustiveSearch = EXH_NEVER;
+		if (m_timings)
+			m_timings->plan(modeNames[m_exhaustiveSearch], "streamed");
+		return;
+	}
+	typedef std::chrono::steady_clock clock;
+	auto elapsed = [] (clock::time_point since) {
+		return std::chrono::duration<double>(clock::now() - since).count();
+	};
+
+	const int16_t yMax = mod16(m_yMax) + 1;
+	const int16_t yMin = mod16(m_yMin);
+	const size_t y_range = yMax - yMin;
+
+	BlockPos emin, emax;
+	if (!m_db->getExtent(BlockPos(m_geomX, yMin, m_geomY),
+		BlockPos(m_geomX2, yMax, m_geomY2), emin, emax)) {
+		m_exhaustiveSearch = EXH_NEVER; // nothing to render anyway
+		if (m_timings)
+			m_timings->plan(modeNames[m_exhaustiveSearch], "empty");
+		return;
+	}
+	// (backends that need to load positions have done so by now)
+	const size_t rows = emax.z - emin.z + 1;
+	const size_t area = (emax.x - emin.x + 1) * rows;
+
+	const int maxSamples = mymin<int>(rows, 3);
+	const size_t maxLookups = PLAN_MAX_LOOKUPS / maxSamples;
+	int samples = 0;
+	size_t columns = 0, pointLookups = 0;
+	double listTime = 0, readTime = 0, pointTime = 0;
+	std::vector<BlockPos> positions;
+	const clock::time_point planStart = clock::now();
+	for (int i = 0; i < maxSamples; i++) {
+		// stop once over budget, but always sample at least one row
+		if (i > 0 && elapsed(planStart) > PLAN_MAX_TIME)
+			break;
+		samples++;
+		const int16_t z = emin.z + (rows * (2 * i + 1)) / (2 * maxSamples);
+
+		clock::time_point start = clock::now();
+		std::vector<BlockPos> vec = m_db->getBlockPos(BlockPos(emin.x, yMin, z),
+			BlockPos(emax.x + 1, yMax, z + 1));
+		listTime += elapsed(start);
+
+		std::set<int16_t> xs;
+		for (auto pos : vec)
+			xs.insert(pos.x);
+		columns += xs.size();
+
+		// read columns the way the renderer would (but completely)
+		const BlockVisitor all = [] (BlockPos, const u8 *, size_t) { return true; };
+		start = clock::now();
+		for (auto it = xs.rbegin(); it != xs.rend(); ++it)
+			m_db->visitBlocksOnXZ(*it, z, yMin, yMax, all);
+		readTime += elapsed(start);
+
+		// and look up some positions one by one
+		positions.clear();
+		for (auto it = xs.rbegin(); it != xs.rend() && positions.size() < maxLookups; ++it) {
+			for (int16_t y = yMax - 1; y >= yMin && positions.size() < maxLookups; y--)
+				positions.emplace_back(*it, y, z);
+		}
+		start = clock::now();
+		m_db->visitBlocksByPos(positions, all);
+		pointTime += elapsed(start);
+		pointLookups += positions.size();
+	}
+
+	const double scale = (double) rows / samples;
+	const double pointCost = pointLookups ? pointTime / pointLookups : 0;
+	const double listCost = listTime * scale;
+	const double cost[3] = {
+		listCost + readTime * scale, // EXH_NEVER
+		listCost + pointCost * columns * scale * y_range, // EXH_Y
+		pointCost * area * y_range, // EXH_FULL
+	};
+	m_exhaustiveSearch = EXH_NEVER;
+	if (cost[EXH_Y] < cost[m_exhaustiveSearch])
+		m_exhaustiveSearch = EXH_Y;
+	if (cost[EXH_FULL] < cost[m_exhaustiveSearch])
+		m_exhaustiveSearch = EXH_FULL;
+
+	if (m_timings)
+		m_timings->plan(modeNames[m_exhaustiveSearch], "sampled", samples, rows, cost);
+#ifndef NDEBUG
+	std::cerr << "Traversal planner: sampled " << samples << " of " << rows
+		<< " rows, " << columns << " columns, " << pointLookups << " lookups" << std::endl
+		<< "  estimated time: never=" << cost[EXH_NEVER] << "s y=" << cost[EXH_Y]
+		<< "s full=" << cost[EXH_FULL] << "s" << std::endl;
+#endif
 }
 
-static inline int16_t mod16(int16_t y)
+void TileGenerator::closeDatabase()
 {
-	if (y < 0)
-		return (y - 15) / 16;
-	return y / 16;
+	if (!m_dbShared)
+		delete m_db;
+	m_db = NULL;
 }
 
 void TileGenerator::loadBlocks()
 {
+	Timings::Scope scope(m_timings.get(), Timings::LIST);
+	Trace::Span span(m_trace.get(), "load positions", "render");
 	const int16_t yMax = mod16(m_yMax) + 1;
 	const int16_t yMin = mod16(m_yMin);
 
 	if (m_exhaustiveSearch == EXH_NEVER || m_exhaustiveSearch == EXH_Y) {
-		std::vector<BlockPos> vec = m_db->getBlockPos(
+		m_db->visitBlockPos(
 			BlockPos(m_geomX, yMin, m_geomY),
-			BlockPos(m_geomX2, yMax, m_geomY2)
+			BlockPos(m_geomX2, yMax, m_geomY2),
+			[&] (BlockPos pos) {
+				assert(pos.x >= m_geomX && pos.x < m_geomX2);
+				assert(pos.y >= yMin && pos.y < yMax);
+				assert(pos.z >= m_geomY && pos.z < m_geomY2);
+
+				// Adjust minimum and maximum positions to the nearest block
+				if (pos.x < m_xMin)
+					m_xMin = pos.x;
+				if (pos.x > m_xMax)
+					m_xMax = pos.x;
+
+				if (pos.z < m_zMin)
+					m_zMin = pos.z;
+				if (pos.z > m_zMax)
+					m_zMax = pos.z;
+
+				m_positions.add(pos.x, pos.z);
+			}
 		);
+		m_positions.finalize();
 
-		for (auto pos : vec) {
-			assert(pos.x >= m_geomX && pos.x < m_geomX2);
-			assert(pos.y >= yMin && pos.y < yMax);
-			assert(pos.z >= m_geomY && pos.z < m_geomY2);
+		m_progressMax = m_positions.size();
+#ifndef NDEBUG
+		std::cerr << "Loaded " << m_positions.size()
+			<< " positions for rendering" << std::endl;
+#endif
+	} else {
+		// Nothing to load, but the map still needs to be cropped
+		loadExtent();
+	}
+}
 
-			// Adjust minimum and maximum positions to the nearest block
-			if (pos.x < m_xMin)
-				m_xMin = pos.x;
-			if (pos.x > m_xMax)
-				m_xMax = pos.x;
+void TileGenerator::loadExtent()
+{
+	Timings::Scope scope(m_timings.get(), Timings::LIST);
+	Trace::Span span(m_trace.get(), "load extent", "render");
+	const int16_t yMax = mod16(m_yMax) + 1;
+	const int16_t yMin = mod16(m_yMin);
 
-			if (pos.z < m_zMin)
-				m_zMin = pos.z;
-			if (pos.z > m_zMax)
-				m_zMax = pos.z;
+	BlockPos emin, emax;
+	if (!m_db->getExtent(BlockPos(m_geomX, yMin, m_geomY),
+		BlockPos(m_geomX2, yMax, m_geomY2), emin, emax))
+		return;
+	m_xMin = emin.x;
+	m_xMax = emax.x;
+	m_zMin = emin.z;
+	m_zMax = emax.z;
+}
 
-			m_positions[pos.z].emplace(pos.x);
-		}
+bool TileGenerator::renderIncremental(const std::string &output)
+{
+	// without the previous image there's nothing to update, even if the
+	// map didn't change
+	if (!std::ifstream(output, std::ios::binary).good())
+		return false;
+	std::ifstream ifs(output + ".state");
+	if (!ifs.good())
+		return false;
+	std::string fingerprint = read_setting_default("fingerprint", ifs, "");
+	ifs.seekg(0);
+	std::string token = read_setting_default("token", ifs, "");
+	ifs.seekg(0);
+	std::istringstream extent(read_setting_default("extent", ifs, ""));
+	ifs.close();
+
+	int xMin, xMax, zMin, zMax;
+	extent >> xMin >> xMax >> zMin >> zMax;
+	if (extent.fail() || fingerprint != getStateFingerprint())
+		return false;
+
+	std::vector<BlockPos> changed;
+	{
+		Timings::Scope scope(m_timings.get(), Timings::LIST);
+		if (!m_db->getChangedBlockPos(token, changed))
+			return false;
+	}
 
-		size_t count = 0;
-		for (const auto &it : m_positions)
-			count += it.second.size();
-		m_progressMax = count;
+	// Redraw changed columns and the ones whose shading depends on them
+	const int16_t yMax = mod16(m_yMax) + 1;
+	const int16_t yMin = mod16(m_yMin);
+	std::map<int16_t, std::set<int16_t>> dirty;
+	for (auto pos : changed) {
+		if (pos.x < m_geomX || pos.x >= m_geomX2 ||
+			pos.y < yMin || pos.y >= yMax ||
+			pos.z < m_geomY || pos.z >= m_geomY2)
+			continue;
+		if (pos.x < xMin || pos.x > xMax || pos.z < zMin || pos.z > zMax)
+			return false; // map has grown
+		dirty[pos.z].insert(pos.x);
+		if (pos.x < xMax)
+			dirty[pos.z].insert(pos.x + 1);
+		if (pos.z > zMin)
+			dirty[pos.z - 1].insert(pos.x);
+	}
 #ifndef NDEBUG
-		std::cerr << "Loaded " << count
-			<< " positions (across Z: " << m_positions.size() << ") for rendering" << std::endl;
+	std::cerr << "Incremental: " << changed.size() << " changed blocks, "
+		<< dirty.size() << " rows to patch" << std::endl;
 #endif
+	if (dirty.empty())
+		return true;
+
+	std::unique_ptr<Image> previous;
+	try {
+		Timings::Scope scope(m_timings.get(), Timings::ENCODE);
+		Trace::Span span(m_trace.get(), "read previous image", "render");
+		previous.reset(new Image(output));
+	} catch (const std::runtime_error &e) {
+		return false;
+	}
+
+	// Neighbours to the west and north are rendered too since they're
+	// needed for the shading, but won't be copied into the image.
+	m_positions.clear();
+	for (const auto &it : dirty) {
+		for (int16_t x : it.second) {
+			m_positions.add(x, it.first);
+			if (x > xMin)
+				m_positions.add(x - 1, it.first);
+			if (it.first < zMax)
+				m_positions.add(x, it.first + 1);
+		}
+	}
+	m_positions.finalize();
+	m_progressMax = m_positions.size();
+	if (m_exhaustiveSearch == EXH_FULL)
+		m_exhaustiveSearch = EXH_Y;
+
+	m_xMin = xMin;
+	m_xMax = xMax;
+	m_zMin = zMin;
+	m_zMax = zMax;
+	createImage();
+	if (previous->getWidth() != m_image->getWidth() ||
+		previous->getHeight() != m_image->getHeight()) {
+		delete m_image;
+		m_image = nullptr;
+		m_positions.clear();
+		m_xMin = m_zMin = INT_MAX;
+		m_xMax = m_zMax = INT_MIN;
+		return false;
+	}
+	renderMap();
+
+	const int size = 16 * m_zoom;
+	for (const auto &it : dirty) {
+		for (int16_t x : it.second) {
+			previous->copyRect(*m_image,
+				getImageX((x - m_xMin) * 16), getImageY((m_zMax - it.first) * 16),
+				size, size);
+		}
+	}
+	delete m_image;
+	m_image = previous.release();
+
+	if (m_drawOrigin) {
+		Timings::Scope scope(m_timings.get(), Timings::DRAW);
+		renderOrigin();
 	}
+	writeImage(output);
+	return true;
 }
 
-void TileGenerator::createImage()
+std::string TileGenerator::getStateFingerprint() const
+{
+	// anything that influences the pixels of the map goes in here
+	uint32_t colors = 0;
+	for (const auto &it : m_colorMap) {
+		uint32_t h = 2166136261U; // FNV-1a
+		auto feed = [&h] (u8 c) {
+			h = (h ^ c) * 16777619U;
+		};
+		for (char c : it.first)
+			feed(c);
+		const ColorEntry &e = it.second;
+		for (u8 c : {e.r, e.g, e.b, e.a, e.t})
+			feed(c);
+		colors += h; // independent of iteration order
+	}
+
+	auto color = [] (const Color &c) {
+		return (c.r << 16) | (c.g << 8) | c.b;
+	};
+	std::ostringstream oss;
+	oss << m_geomX << " " << m_geomY << " " << m_geomX2 << " " << m_geomY2
+		<< " " << m_yMin << " " << m_yMax << " " << m_zoom
+		<< " " << (m_drawScale ? m_scales : 0) << " " << m_drawOrigin
+		<< " " << m_drawAlpha << " " << m_shading
+		<< " " << color(m_bgColor) << " " << color(m_scaleColor)
+		<< " " << color(m_originColor) << " " << colors;
+	return oss.str();
+}
+
+void TileGenerator::writeState(const std::string &output, const std::string &changeToken)
+{
+	std::ofstream ofs(output + ".state");
+	if (!ofs.good())
+		throw std::runtime_error("Failed to write incremental state file");
+	ofs << "fingerprint = " << getStateFingerprint() << "\n"
+		<< "token = " << changeToken << "\n"
+		<< "extent = " << m_xMin << " " << m_xMax
+		<< " " << m_zMin << " " << m_zMax << "\n";
+}
+
+// returns the size of the image
+void TileGenerator::setupImageArea(int &image_width, int &image_height)
 {
 	const int scale_d = 40; // pixels reserved for a scale
 	if(!m_drawScale)
@@ -504,11 +1464,18 @@ void TileGenerator::createImage()
 	m_yBorder = (m_scales & SCALE_TOP) ? scale_d : 0;
 	m_blockPixelAttributes.setWidth(m_mapWidth);
 
-	int image_width, image_height;
 	image_width = (m_mapWidth * m_zoom) + m_xBorder;
 	image_width += (m_scales & SCALE_RIGHT) ? scale_d : 0;
 	image_height = (m_mapHeight * m_zoom) + m_yBorder;
 	image_height += (m_scales & SCALE_BOTTOM) ? scale_d : 0;
+}
+
+void TileGenerator::createImage()
+{
+	Timings::Scope scope(m_timings.get(), Timings::DRAW);
+	Trace::Span span(m_trace.get(), "create image", "render");
+	int image_width, image_height;
+	setupImageArea(image_width, image_height);
 
 	if(image_width > 4096 || image_height > 4096) {
 		std::cerr << "Warning: The width or height of the image to be created exceeds 4096 pixels!"
@@ -521,61 +1488,155 @@ void TileGenerator::createImage()
 
 void TileGenerator::renderMap()
 {
+	Timings *timings = m_timings.get();
+	Trace *trace = m_trace.get();
 	BlockDecoder blk;
+	blk.setTimings(timings);
+	blk.setTrace(trace);
 	const int16_t yMax = mod16(m_yMax) + 1;
 	const int16_t yMin = mod16(m_yMin);
 	size_t count = 0;
-
-	auto renderSingle = [&] (int16_t xPos, int16_t zPos, BlockList &blockStack) {
-		m_readPixels.reset();
-		m_readInfo.reset();
-		for (int i = 0; i < 16; i++) {
-			for (int j = 0; j < 16; j++) {
-				m_color[i][j] = m_bgColor; // This will be drawn by renderMapBlockBottom() for y-rows with only 'air', 'ignore' or unknown nodes if --drawalpha is used
-				m_color[i][j].a = 0; // ..but set alpha to 0 to tell renderMapBlock() not to use this color to mix a shade
-				m_thickness[i][j] = 0;
+	m_progressStart = m_progressNext = std::chrono::steady_clock::now();
+	m_progressBlocks = m_progressBytes = 0;
+
+	/* A column is rendered from the top down, block by block, until all
+	 * pixels are covered. */
+	int16_t colX = 0, colZ = 0;
+	BlockPos colTop;
+	bool colStarted = false;
+	auto beginSingle = [&] (int16_t xPos, int16_t zPos) {
+		colX = xPos;
+		colZ = zPos;
+		colStarted = false;
+		m_progressRow = zPos;
+	};
+	// returns false once there is nothing more to do for this column
+	const BlockVisitor renderSingleBlock = [&] (BlockPos pos, const u8 *data, size_t size) {
+		assert(pos.x == colX && pos.z == colZ);
+		assert(pos.y >= yMin && pos.y < yMax);
+		Timings::Scope scope(timings, Timings::RENDER);
+		if (timings) {
+			timings->count(Timings::BLOCKS_READ);
+			timings->count(Timings::BYTES_READ, size);
+		}
+		m_progressBlocks++;
+		m_progressBytes += size;
+		if (!colStarted) {
+			m_readPixels.reset();
+			m_readInfo.reset();
+			for (int i = 0; i < 16; i++) {
+				for (int j = 0; j < 16; j++) {
+					m_color[i][j] = m_bgColor; // This will be drawn by renderMapBlockBottom() for y-rows with only 'air', 'ignore' or unknown nodes if --drawalpha is used
+					m_color[i][j].a = 0; // ..but set alpha to 0 to tell renderMapBlock() not to use this color to mix a shade
+					m_thickness[i][j] = 0;
+				}
 			}
+			colTop = pos;
+			colStarted = true;
 		}
 
-		for (const auto &it : blockStack) {
-			const BlockPos pos = it.first;
-			assert(pos.x == xPos && pos.z == zPos);
-			assert(pos.y >= yMin && pos.y < yMax);
-
-			blk.reset();
-			blk.decode(it.second);
-			if (blk.isEmpty())
-				continue;
+		if (m_blockCache) {
+			BlockCache::Block cached = m_blockCache->get(pos);
+			if (!cached) {
+				Timings::Scope scope(timings, Timings::DECODE);
+				if (timings)
+					timings->count(Timings::BLOCKS_DECODED);
+				blk.reset();
+				blk.decode(data, size);
+				DecodedBlock *decoded = new DecodedBlock();
+				cached.reset(decoded);
+				blk.resolve(*decoded);
+				m_blockCache->put(pos, cached);
+			}
+			if (cached->isEmpty()) {
+				if (timings)
+					timings->count(Timings::BLOCKS_EMPTY);
+				return true;
+			}
+			renderMapBlock(*cached, pos);
+		} else {
+			{
+				Timings::Scope scope(timings, Timings::DECODE);
+				if (timings)
+					timings->count(Timings::BLOCKS_DECODED);
+				blk.reset();
+				blk.decode(data, size);
+			}
+			if (blk.isEmpty()) {
+				if (timings)
+					timings->count(Timings::BLOCKS_EMPTY);
+				return true;
+			}
 			renderMapBlock(blk, pos);
+		}
 
-			// Exit out if all pixels for this MapBlock are covered
-			if (m_readPixels.full())
-				break;
+		// Exit out if all pixels for this MapBlock are covered
+		if (m_readPixels.full()) {
+			if (timings)
+				timings->count(Timings::COLUMNS_COVERED);
+			return false;
 		}
+		return true;
+	};
+	auto endSingle = [&] () {
+		if (!colStarted)
+			return;
+		Timings::Scope scope(timings, Timings::RENDER);
+		if (timings)
+			timings->count(Timings::COLUMNS);
 		if (!m_readPixels.full())
-			renderMapBlockBottom(blockStack.begin()->first);
+			renderMapBlockBottom(colTop);
 		m_renderedAny |= m_readInfo.any();
 	};
+	// the span of a row ends with its shading
+	Trace::Clock::time_point rowStart;
+	if (trace)
+		rowStart = Trace::Clock::now();
 	auto postRenderRow = [&] (int16_t zPos) {
-		if (m_shading)
+		if (m_surfaceCache) {
+			Timings::Scope scope(timings, Timings::ENCODE);
+			m_surfaceCache->writeRow(zPos, m_surfaceRow.data());
+			for (auto &px : m_surfaceRow)
+				px.reset();
+		}
+		if (m_shading) {
+			Timings::Scope scope(timings, Timings::SHADING);
+			Trace::Span span(trace, "shading", "render");
 			renderShading(zPos);
+		}
+		if (trace) {
+			Trace::Clock::time_point now = Trace::Clock::now();
+			trace->add("row", "render", rowStart, now,
+				"\"z\":" + std::to_string(zPos) + trace->fineTotals(), false);
+			rowStart = now;
+		}
+	};
+	// the database calls the renderer, whose time is counted separately
+	auto visitColumn = [&] (int16_t xPos, int16_t zPos) {
+		Timings::Scope scope(timings, Timings::READ);
+		Trace::Span span(trace, "column", "render", true);
+		m_db->visitBlocksOnXZ(xPos, zPos, yMin, yMax, renderSingleBlock);
+	};
+	auto visitPositions = [&] (const std::vector<BlockPos> &positions) {
+		Timings::Scope scope(timings, Timings::READ);
+		Trace::Span span(trace, "column", "render", true);
+		m_db->visitBlocksByPos(positions, renderSingleBlock);
 	};
 
 	if (m_exhaustiveSearch == EXH_NEVER) {
-		for (auto it = m_positions.rbegin(); it != m_positions.rend(); ++it) {
-			int16_t zPos = it->first;
-			for (auto it2 = it->second.rbegin(); it2 != it->second.rend(); ++it2) {
-				int16_t xPos = *it2;
-
-				BlockList blockStack;
-				m_db->getBlocksOnXZ(blockStack, xPos, zPos, yMin, yMax);
-				blockStack.sort();
-
-				renderSingle(xPos, zPos, blockStack);
-				reportProgress(count++);
+		m_positions.forEachRowReverse([&] (int16_t zPos, const std::vector<int16_t> &xs) {
+			{
+				Timings::Scope scope(timings, Timings::READ);
+				m_db->prefetchRow(zPos, xs, yMin, yMax);
+			}
+			for (int16_t xPos : xs) {
+				beginSingle(xPos, zPos);
+				visitColumn(xPos, zPos);
+				endSingle();
+				reportProgress(++count);
 			}
 			postRenderRow(zPos);
-		}
+		});
 	} else if (m_exhaustiveSearch == EXH_Y) {
 #ifndef NDEBUG
 		std::cerr << "Exhaustively searching height of "
@@ -583,56 +1644,55 @@ void TileGenerator::renderMap()
 #endif
 		std::vector<BlockPos> positions;
 		positions.reserve(yMax - yMin);
-		for (auto it = m_positions.rbegin(); it != m_positions.rend(); ++it) {
-			int16_t zPos = it->first;
-			for (auto it2 = it->second.rbegin(); it2 != it->second.rend(); ++it2) {
-				int16_t xPos = *it2;
-
-				positions.clear();
-				for (int16_t yPos = yMin; yPos < yMax; yPos++)
-					positions.emplace_back(xPos, yPos, zPos);
-
-				BlockList blockStack;
-				m_db->getBlocksByPos(blockStack, positions);
-				blockStack.sort();
-
-				renderSingle(xPos, zPos, blockStack);
-				reportProgress(count++);
-			}
-			postRenderRow(zPos);
-		}
+		m_positions.forEachReverse([&] (int16_t xPos, int16_t zPos) {
+			positions.clear();
+			for (int16_t yPos = yMax - 1; yPos >= yMin; yPos--)
+				positions.emplace_back(xPos, yPos, zPos);
+
+			beginSingle(xPos, zPos);
+			visitPositions(positions);
+			endSingle();
+			reportProgress(++count);
+		}, postRenderRow);
 	} else if (m_exhaustiveSearch == EXH_FULL) {
+		// only search the part of the geometry that is on the image
+		const int xFirst = mymax<int>(m_geomX, m_xMin);
+		const int xLast = mymin(m_geomX2 - 1, m_xMax);
+		const int zFirst = mymax<int>(m_geomY, m_zMin);
+		const int zLast = mymin(m_geomY2 - 1, m_zMax);
+		const size_t span_x = xLast >= xFirst ? xLast - xFirst + 1 : 0;
 		const size_t span_y = yMax - yMin;
-		m_progressMax = (m_geomX2 - m_geomX) * span_y * (m_geomY2 - m_geomY);
+		const size_t span_z = zLast >= zFirst ? zLast - zFirst + 1 : 0;
+		m_progressMax = span_x * span_z; // counted per column
 #ifndef NDEBUG
 		std::cerr << "Exhaustively searching "
-			<< (m_geomX2 - m_geomX) << "x" << span_y << "x"
-			<< (m_geomY2 - m_geomY) << " blocks" << std::endl;
+			<< span_x << "x" << span_y << "x" << span_z << " blocks" << std::endl;
 #endif
 
 		std::vector<BlockPos> positions;
 		positions.reserve(span_y);
-		for (int16_t zPos = m_geomY2 - 1; zPos >= m_geomY; zPos--) {
-			for (int16_t xPos = m_geomX2 - 1; xPos >= m_geomX; xPos--) {
+		for (int zPos = zLast; zPos >= zFirst; zPos--) {
+			for (int xPos = xLast; xPos >= xFirst; xPos--) {
 				positions.clear();
-				for (int16_t yPos = yMin; yPos < yMax; yPos++)
+				for (int16_t yPos = yMax - 1; yPos >= yMin; yPos--)
 					positions.emplace_back(xPos, yPos, zPos);
 
-				BlockList blockStack;
-				m_db->getBlocksByPos(blockStack, positions);
-				blockStack.sort();
-
-				renderSingle(xPos, zPos, blockStack);
-				reportProgress(count++);
+				beginSingle(xPos, zPos);
+				visitPositions(positions);
+				endSingle();
+				reportProgress(++count);
 			}
 			postRenderRow(zPos);
 		}
 	}
 
-	reportProgress(m_progressMax);
+	// the last column has reported it already, unless there were none
+	if (count != m_progressMax || count == 0)
+		reportProgress(m_progressMax);
 }
 
-void TileGenerator::renderMapBlock(const BlockDecoder &blk, const BlockPos &pos)
+template<typename Block>
+void TileGenerator::renderMapBlock(const Block &blk, const BlockPos &pos)
 {
 	int xBegin = (pos.x - m_xMin) * 16;
 	int zBegin = (m_zMax - pos.z) * 16;
@@ -645,6 +1705,8 @@ void TileGenerator::renderMapBlock(const BlockDecoder &blk, const BlockPos &pos)
 				continue;
 			int imageX = xBegin + x;
 			auto &attr = m_blockPixelAttributes.attribute(15 - z, xBegin + x);
+			SurfacePixel *px = m_surfaceCache ?
+				&m_surfaceRow[(15 - z) * m_mapWidth + imageX] : nullptr;
 
 			for (int y = maxY; y >= minY; --y) {
 				const std::string &name = blk.getNode(x, y, z);
@@ -666,6 +1728,8 @@ void TileGenerator::renderMapBlock(const BlockDecoder &blk, const BlockPos &pos)
 						// remember color and near thickness value
 						m_color[z][x] = c;
 						m_thickness[z][x] = (m_thickness[z][x] + it->second.t) / 2;
+						if (px)
+							px->addAlpha(m_surfaceCache->intern(name), pos.y * 16 + y);
 						continue;
 					}
 					// color became opaque, draw it
@@ -683,6 +1747,11 @@ void TileGenerator::renderMapBlock(const BlockDecoder &blk, const BlockPos &pos)
 					attr.height = pos.y * 16 + y;
 					m_readInfo.set(x, z);
 				}
+				if (px) {
+					px->node = m_surfaceCache->intern(name);
+					px->height = attr.height;
+					px->drawn = 1;
+				}
 				break;
 			}
 		}
@@ -708,6 +1777,8 @@ void TileGenerator::renderMapBlockBottom(const BlockPos &pos)
 			setZoomed(imageX, imageY, m_color[z][x]);
 			m_readPixels.set(x, z);
 			attr.thickness = m_thickness[z][x];
+			if (m_surfaceCache)
+				m_surfaceRow[(15 - z) * m_mapWidth + imageX].drawn = 1;
 		}
 	}
 }
@@ -852,9 +1923,14 @@ void TileGenerator::renderPlayers(const std::string &input_path)
 
 void TileGenerator::writeImage(const std::string &output)
 {
-	m_image->save(output);
-	delete m_image;
+	Timings::Scope scope(m_timings.get(), Timings::ENCODE);
+	Trace::Span span(m_trace.get(), "write image", "render");
+	std::unique_ptr<Image> image(m_image);
 	m_image = nullptr;
+	if (m_imageSink)
+		m_imageSink(*image);
+	else
+		image->save(output);
 }
 
 void TileGenerator::printUnknown()
@@ -871,9 +1947,25 @@ void TileGenerator::printUnknown()
 	}
 }
 
+void TileGenerator::printTimings()
+{
+	if (m_timings)
+		m_timings->print(std::cerr, m_timingsJson);
+}
+
+void TileGenerator::writeTrace()
+{
+	if (m_trace)
+		m_trace->write();
+}
+
 void TileGenerator::reportProgress(size_t count)
 {
-	if (!m_progressMax)
+	if (m_progressFd >= 0) {
+		writeProgressLine(count);
+		return;
+	}
+	if (!m_showProgress || !m_progressMax)
 		return;
 	int percent = count / static_cast<float>(m_progressMax) * 100;
 	if (percent == m_progressLast)
@@ -892,6 +1984,51 @@ void TileGenerator::reportProgress(size_t count)
 	std::cout.flush();
 }
 
+void TileGenerator::writeProgressLine(size_t count)
+{
+	auto now = std::chrono::steady_clock::now();
+	bool last = count >= m_progressMax;
+	if (now < m_progressNext && !last)
+		return;
+	m_progressNext = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double>(m_progressInterval));
+
+	double elapsed = std::chrono::duration<double>(now - m_progressStart).count();
+	double rate = elapsed > 0 ? 1 / elapsed : 0;
+	std::ostringstream os;
+	os << std::fixed << std::setprecision(3);
+	os << "{\"output\":" << Trace::quote(m_progressOutput)
+		<< ",\"done\":" << count << ",\"total\":" << m_progressMax
+		<< ",\"row\":" << m_progressRow
+		<< ",\"blocks\":" << m_progressBlocks << ",\"bytes\":" << m_progressBytes
+		<< ",\"blocks_per_s\":" << m_progressBlocks * rate
+		<< ",\"bytes_per_s\":" << m_progressBytes * rate
+		<< ",\"elapsed\":" << elapsed << ",\"eta\":";
+	// assumes the remaining columns take as long as the ones so far
+	if (last)
+		os << 0.0;
+	else if (count > 0)
+		os << elapsed / count * (m_progressMax - count);
+	else
+		os << "null";
+	os << "}\n";
+	const std::string line = os.str();
+
+	// a single write so that the lines of parallel jobs don't mix
+#ifdef _WIN32
+	int ret = _write(m_progressFd, line.data(), line.size());
+#else
+	/* send() doesn't raise SIGPIPE when the reader went away, but only works
+	 * on sockets. For pipes the program has to ignore the signal. */
+	ssize_t ret = send(m_progressFd, line.data(), line.size(), MSG_NOSIGNAL);
+	if (ret < 0 && errno == ENOTSOCK)
+		ret = write(m_progressFd, line.data(), line.size());
+#endif
+	// nobody is reading anymore, which is no reason to stop rendering
+	if (ret < 0 && (errno == EPIPE || errno == EBADF))
+		m_progressFd = -1;
+}
+
 inline int TileGenerator::getImageX(int val, bool absolute) const
 {
 	if (absolute)
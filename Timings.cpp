@@ -0,0 +1,189 @@
+#include <ctime>
+#include <iomanip>
+
+#include "Timings.h"
+
+static const char *const stageNames[Timings::STAGE_COUNT] = {
+	"other",
+	"open",
+	"plan",
+	"list",
+	"read",
+	"decompress",
+	"decode",
+	"render",
+	"shading",
+	"draw",
+	"encode",
+};
+
+static const char *const counterNames[Timings::COUNTER_COUNT] = {
+	"blocks_read",
+	"bytes_read",
+	"blocks_decoded",
+	"bytes_decompressed",
+	"blocks_empty",
+	"columns",
+	"columns_covered",
+	"cache_hits",
+	"cache_misses",
+	"cache_evictions",
+};
+
+// of the calling thread where possible
+static double cpuTime()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+	return (double) std::clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+Timings::Timings() :
+	m_start(Clock::now()), m_last(m_start), m_lastCpu(cpuTime()),
+	m_stage(OTHER), m_wall(), m_cpu(), m_counters(),
+	m_planMode(nullptr), m_planReason(nullptr), m_planSamples(0),
+	m_planRows(0), m_planCost(), m_planEstimated(false), m_merged(false)
+{
+}
+
+Timings::Stage Timings::enter(Stage stage)
+{
+	Clock::time_point now = Clock::now();
+	double cpu = cpuTime();
+	m_wall[m_stage] += std::chrono::duration<double>(now - m_last).count();
+	m_cpu[m_stage] += cpu - m_lastCpu;
+	m_last = now;
+	m_lastCpu = cpu;
+
+	Stage previous = m_stage;
+	m_stage = stage;
+	return previous;
+}
+
+void Timings::skip()
+{
+	m_last = Clock::now();
+	m_lastCpu = cpuTime();
+}
+
+void Timings::plan(const char *mode, const char *reason,
+	int samples, int rows, const double *cost)
+{
+	m_planMode = mode;
+	m_planReason = reason;
+	m_planSamples = samples;
+	m_planRows = rows;
+	m_planEstimated = cost != nullptr;
+	for (int i = 0; i < 3 && cost; i++)
+		m_planCost[i] = cost[i];
+}
+
+void Timings::merge(const Timings &other)
+{
+	// parallel jobs each plan their part, show the first of them
+	if (!m_planMode && other.m_planMode) {
+		plan(other.m_planMode, other.m_planReason, other.m_planSamples,
+			other.m_planRows, other.m_planEstimated ? other.m_planCost : nullptr);
+	}
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		m_wall[i] += other.m_wall[i];
+		m_cpu[i] += other.m_cpu[i];
+	}
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		m_counters[i] += other.m_counters[i];
+	m_merged = true;
+}
+
+void Timings::print(std::ostream &os, bool json)
+{
+	enter(m_stage); // count the time up to now
+
+	double wall = std::chrono::duration<double>(m_last - m_start).count();
+	double thread = 0, cpu = 0;
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		thread += m_wall[i];
+		cpu += m_cpu[i];
+	}
+	// of the stages, see the comment in Timings.h
+	const char *stageTime = m_merged ? "thread" : "wall";
+
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+	os << std::fixed << std::setprecision(3);
+	if (json) {
+		os << "{\"wall\":" << wall;
+		if (m_merged)
+			os << ",\"thread\":" << thread;
+		os << ",\"cpu\":" << cpu << ",\"stages\":{";
+		for (int i = 0; i < STAGE_COUNT; i++) {
+			os << (i > 0 ? "," : "") << "\"" << stageNames[i] << "\":{\""
+				<< stageTime << "\":" << m_wall[i] << ",\"cpu\":" << m_cpu[i] << "}";
+		}
+		os << "}";
+		for (int i = 0; i < COUNTER_COUNT; i++)
+			os << ",\"" << counterNames[i] << "\":" << m_counters[i];
+		if (m_planMode) {
+			os << ",\"traversal\":{\"mode\":\"" << m_planMode << "\",\"reason\":\""
+				<< m_planReason << "\"";
+			if (m_planEstimated) {
+				os << ",\"sampled_rows\":" << m_planSamples << ",\"rows\":" << m_planRows
+					<< ",\"estimates\":{\"never\":" << m_planCost[0] << ",\"y\":"
+					<< m_planCost[1] << ",\"full\":" << m_planCost[2] << "}";
+			}
+			os << "}";
+		}
+		os << "}" << std::endl;
+		os.flags(flags);
+		os.precision(precision);
+		return;
+	}
+
+	os << "Timings (seconds):" << std::endl;
+	os << "\t" << std::left << std::setw(12) << "stage" << std::right
+		<< std::setw(9) << stageTime << " " << std::setw(9) << "cpu" << std::endl;
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		os << "\t" << std::left << std::setw(12) << stageNames[i] << std::right
+			<< std::setw(9) << m_wall[i] << " " << std::setw(9) << m_cpu[i]
+			<< std::endl;
+	}
+	os << "\t" << std::left << std::setw(12) << "total" << std::right
+		<< std::setw(9) << (m_merged ? thread : wall) << " " << std::setw(9) << cpu
+		<< std::endl;
+	if (m_merged)
+		os << "Wall time: " << wall << std::endl;
+
+	if (m_planMode) {
+		os << "Traversal: " << m_planMode << " (" << m_planReason;
+		if (m_planEstimated) {
+			os << ", " << m_planSamples << " of " << m_planRows << " rows sampled"
+				<< ", estimated never=" << m_planCost[0]
+				<< "s y=" << m_planCost[1] << "s full=" << m_planCost[2] << "s";
+		}
+		os << ")" << std::endl;
+	}
+
+	const double mib = 1024.0 * 1024.0;
+	os << std::setprecision(1);
+	os << "Blocks: " << m_counters[BLOCKS_READ] << " read ("
+		<< (m_counters[BYTES_READ] / mib) << " MiB), "
+		<< m_counters[BLOCKS_DECODED] << " decoded ("
+		<< (m_counters[BYTES_DECOMPRESSED] / mib) << " MiB decompressed), "
+		<< m_counters[BLOCKS_EMPTY] << " empty" << std::endl;
+	os << "Columns: " << m_counters[COLUMNS] << ", "
+		<< m_counters[COLUMNS_COVERED] << " covered before the bottom" << std::endl;
+	if (m_counters[CACHE_HITS] || m_counters[CACHE_MISSES]) {
+		os << "Block cache: " << m_counters[CACHE_HITS] << " hits, "
+			<< m_counters[CACHE_MISSES] << " misses, "
+			<< m_counters[CACHE_EVICTIONS] << " evictions" << std::endl;
+	}
+	if (wall > 0) {
+		os << "Throughput: " << (m_counters[BLOCKS_READ] / wall) << " blocks/s, "
+			<< (m_counters[BYTES_READ] / mib / wall) << " MiB/s read" << std::endl;
+	}
+	os.flags(flags);
+	os.precision(precision);
+}
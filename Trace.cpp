@@ -0,0 +1,127 @@
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "Trace.h"
+
+// fine spans shorter than this (in microseconds) are only added up
+#define FINE_SPAN_MIN 1000
+// events kept in memory before they are written to the file
+#define FLUSH_EVENTS 4096
+
+Trace::Trace(const std::string &path) :
+	m_file(path), m_first(true), m_start(Clock::now())
+{
+	if (!m_file.good())
+		throw std::runtime_error("Failed to open trace file");
+	m_file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+}
+
+int Trace::threadId()
+{
+	auto it = m_threadIds.find(std::this_thread::get_id());
+	if (it != m_threadIds.end())
+		return it->second;
+	int tid = m_threadIds.size() + 1;
+	m_threadIds[std::this_thread::get_id()] = tid;
+	return tid;
+}
+
+void Trace::add(const char *name, const char *category, Clock::time_point start,
+	Clock::time_point end, const std::string &args, bool fine)
+{
+	typedef std::chrono::duration<double, std::micro> Micros;
+	double dur = Micros(end - start).count();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	int tid = threadId();
+	if (fine) {
+		std::vector<FineTotal> &totals = m_fineTotals[tid];
+		auto it = totals.begin();
+		while (it != totals.end() && strcmp(it->name, name) != 0)
+			++it;
+		if (it == totals.end())
+			it = totals.insert(it, FineTotal{name, 0, 0});
+		it->count++;
+		it->dur += dur;
+		if (dur < FINE_SPAN_MIN)
+			return;
+	}
+	m_events.push_back(Event{name, category, Micros(start - m_start).count(),
+		dur, tid, args});
+	if (m_events.size() >= FLUSH_EVENTS)
+		flush();
+}
+
+std::string Trace::fineTotals()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_fineTotals.find(threadId());
+	if (it == m_fineTotals.end())
+		return "";
+	std::string ret;
+	char buf[64];
+	for (const auto &total : it->second) {
+		snprintf(buf, sizeof(buf), "%.3f", total.dur);
+		ret += ",\"" + std::string(total.name) + "\":{\"count\":" +
+			std::to_string(total.count) + ",\"dur\":" + buf + "}";
+	}
+	m_fineTotals.erase(it);
+	return ret;
+}
+
+void Trace::setThreadName(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_threadNames[threadId()] = name;
+}
+
+void Trace::flush()
+{
+	char buf[64];
+	for (const auto &e : m_events) {
+		snprintf(buf, sizeof(buf), "\"ts\":%.3f,\"dur\":%.3f", e.ts, e.dur);
+		m_file << (m_first ? "\n" : ",\n") << "{\"name\":\"" << e.name
+			<< "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\"," << buf
+			<< ",\"pid\":1,\"tid\":" << e.tid;
+		if (!e.args.empty())
+			m_file << ",\"args\":{" << e.args << "}";
+		m_file << "}";
+		m_first = false;
+	}
+	m_events.clear();
+}
+
+void Trace::write()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	flush();
+	// the names can come after the events of their threads
+	for (const auto &it : m_threadNames) {
+		m_file << (m_first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":1,\"tid\":" << it.first << ",\"args\":{\"name\":"
+			<< quote(it.second) << "}}";
+		m_first = false;
+	}
+	m_file << "\n]}" << std::endl;
+	if (!m_file.good())
+		throw std::runtime_error("Failed to write trace file");
+}
+
+std::string Trace::quote(const std::string &s)
+{
+	std::string ret = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			ret += '\\';
+			ret += c;
+		} else if (static_cast<unsigned char>(c) < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			ret += buf;
+		} else {
+			ret += c;
+		}
+	}
+	return ret + "\"";
+}
@@ -0,0 +1,16 @@
+mark_as_advanced(REDIS_LIBRARY REDIS_INCLUDE_DIR)
+
+find_path(REDIS_INCLUDE_DIR NAMES hiredis/hiredis.h)
+
+find_library(REDIS_LIBRARY NAMES hiredis)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Hiredis DEFAULT_MSG REDIS_LIBRARY REDIS_INCLUDE_DIR)
+
+if(HIREDIS_FOUND AND NOT TARGET Hiredis::Hiredis)
+	add_library(Hiredis::Hiredis UNKNOWN IMPORTED)
+	set_target_properties(Hiredis::Hiredis PROPERTIES
+		IMPORTED_LOCATION "${REDIS_LIBRARY}"
+		INTERFACE_INCLUDE_DIRECTORIES "${REDIS_INCLUDE_DIR}"
+	)
+endif()
@@ -0,0 +1,16 @@
+mark_as_advanced(LIBGD_LIBRARY LIBGD_INCLUDE_DIR)
+
+find_path(LIBGD_INCLUDE_DIR NAMES gd.h)
+
+find_library(LIBGD_LIBRARY NAMES gd)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LibGD DEFAULT_MSG LIBGD_LIBRARY LIBGD_INCLUDE_DIR)
+
+if(LIBGD_FOUND AND NOT TARGET LibGD::LibGD)
+	add_library(LibGD::LibGD UNKNOWN IMPORTED)
+	set_target_properties(LibGD::LibGD PROPERTIES
+		IMPORTED_LOCATION "${LIBGD_LIBRARY}"
+		INTERFACE_INCLUDE_DIRECTORIES "${LIBGD_INCLUDE_DIR}"
+	)
+endif()
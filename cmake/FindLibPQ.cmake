@@ -0,0 +1,15 @@
+# libpq, the PostgreSQL client library.
+# Before CMake 3.20 FindPostgreSQL.cmake always looked for server includes
+# but we don't need them, so continue anyway if only those are missing.
+find_package(PostgreSQL QUIET)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LibPQ DEFAULT_MSG PostgreSQL_LIBRARY PostgreSQL_INCLUDE_DIR)
+
+if(LIBPQ_FOUND AND NOT TARGET LibPQ::LibPQ)
+	add_library(LibPQ::LibPQ UNKNOWN IMPORTED)
+	set_target_properties(LibPQ::LibPQ PROPERTIES
+		IMPORTED_LOCATION "${PostgreSQL_LIBRARY}"
+		INTERFACE_INCLUDE_DIRECTORIES "${PostgreSQL_INCLUDE_DIR}"
+	)
+endif()
@@ -0,0 +1,17 @@
+# Defines SQLite::SQLite3 like the module CMake ships since 3.14
+mark_as_advanced(SQLITE3_LIBRARY SQLITE3_INCLUDE_DIR)
+
+find_path(SQLITE3_INCLUDE_DIR NAMES sqlite3.h)
+
+find_library(SQLITE3_LIBRARY NAMES sqlite3)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(SQLite3 DEFAULT_MSG SQLITE3_LIBRARY SQLITE3_INCLUDE_DIR)
+
+if(SQLITE3_FOUND AND NOT TARGET SQLite::SQLite3)
+	add_library(SQLite::SQLite3 UNKNOWN IMPORTED)
+	set_target_properties(SQLite::SQLite3 PROPERTIES
+		IMPORTED_LOCATION "${SQLITE3_LIBRARY}"
+		INTERFACE_INCLUDE_DIRECTORIES "${SQLITE3_INCLUDE_DIR}"
+	)
+endif()
@@ -22,3 +22,11 @@ endif()
 
 include(FindPackageHandleStandardArgs)
 find_package_handle_standard_args(Zstd DEFAULT_MSG ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
+
+if(ZSTD_FOUND AND NOT TARGET Zstd::Zstd)
+	add_library(Zstd::Zstd UNKNOWN IMPORTED)
+	set_target_properties(Zstd::Zstd PROPERTIES
+		IMPORTED_LOCATION "${ZSTD_LIBRARY}"
+		INTERFACE_INCLUDE_DIRECTORIES "${ZSTD_INCLUDE_DIR}"
+	)
+endif()
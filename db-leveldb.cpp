@@ -1,94 +1,420 @@
 #include <stdexcept>
-#include <sstream>
+#include <cstdlib>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "db-leveldb.h"
+#include "Trace.h"
 #include "types.h"
+#include "util.h"
+#include "config.h"
 
-static inline int64_t stoi64(const std::string &s)
+// parses a decimal key, returns false on garbage
+static inline bool stoi64(const leveldb::Slice &s, int64_t &out)
 {
-	std::istringstream tmp(s);
-	int64_t t;
-	tmp >> t;
-	return t;
-}
-
-static inline std::string i64tos(int64_t i)
-{
-	std::ostringstream os;
-	os << i;
-	return os.str();
+	const char *p = s.data();
+	size_t len = s.size();
+	bool neg = len > 0 && p[0] == '-';
+	size_t i = neg ? 1 : 0;
+	if (i == len || len > 20)
+		return false;
+	uint64_t u = 0;
+	for (; i < len; i++) {
+		if (p[i] < '0' || p[i] > '9')
+			return false;
+		u = u * 10 + (p[i] - '0');
+	}
+	out = neg ? -static_cast<int64_t>(u) : u;
+	return true;
 }
 
 
-DBLevelDB::DBLevelDB(const std::string &mapdir)
+DBLevelDB::DBLevelDB(const std::string &mapdir) :
+	dbdir(mapdir + "map.db")
 {
 	leveldb::Options options;
 	options.create_if_missing = false;
-	leveldb::Status status = leveldb::DB::Open(options, mapdir + "map.db", &db);
+	leveldb::Status status = leveldb::DB::Open(options, dbdir, &db);
 	if (!status.ok()) {
 		throw std::runtime_error(std::string("Failed to open Database: ") + status.ToString());
 	}
 
 	/* LevelDB is a dumb key-value store, so the only optimization we can do
 	 * is to cache the block positions that exist in the db.
+	 * This happens on first use, since it's not always needed.
 	 */
-	loadPosCache();
 }
 
 
 DBLevelDB::~DBLevelDB()
 {
+	for (FILE *f : spillFiles) {
+		if (f)
+			fclose(f);
+	}
 	delete db;
 }
 
 
+bool DBLevelDB::setOption(const std::string &name, const std::string &value)
+{
+	if (name == "sequential") {
+		sequential = atoi(value.c_str()) != 0;
+		return true;
+	} else if (name == "index_file") {
+		indexFile = value;
+		return true;
+	} else if (name == "memory_budget") {
+		int mb = atoi(value.c_str());
+		if (mb < 1)
+			throw std::runtime_error("memory_budget needs to be 1 or higher");
+		memoryBudget = static_cast<size_t>(mb) * 1024 * 1024;
+		return true;
+	}
+	return false;
+}
+
+
 std::vector<BlockPos> DBLevelDB::getBlockPos(BlockPos min, BlockPos max)
 {
+	setScanArea(min, max);
+	ensurePosCache();
+
 	std::vector<BlockPos> res;
-	for (const auto &it : posCache) {
-		if (it.first < min.z || it.first >= max.z)
+	posCache.query(min, max, res);
+	return res;
+}
+
+
+bool DBLevelDB::getExtent(BlockPos min, BlockPos max,
+		BlockPos &emin, BlockPos &emax)
+{
+	setScanArea(min, max);
+	ensurePosCache();
+	return posCache.extent(min, max, emin, emax);
+}
+
+
+// Remember the area of the first query so that a sequential scan knows what to keep
+void DBLevelDB::setScanArea(BlockPos min, BlockPos max)
+{
+	if (scanned || scanAreaSet)
+		return;
+	scanMin = min;
+	scanMax = max;
+	scanAreaSet = true;
+}
+
+
+void DBLevelDB::ensurePosCache()
+{
+	if (posCacheLoaded)
+		return;
+	posCacheLoaded = true;
+
+	std::string tag;
+	if (!indexFile.empty()) {
+		tag = getWorldTag();
+		if (posCache.load(indexFile, tag))
+			return;
+	}
+	// the blocks themselves are needed too, so read everything only once
+	if (sequential)
+		scanAll(true);
+	else
+		loadPosCache();
+	if (!indexFile.empty())
+		posCache.save(indexFile, tag);
+}
+
+
+/* LevelDB does not expose a sequence number, but opening the database
+ * flushes the log into a table file. So unless something was written in
+ * the meantime, the table files stay the same and the log stays empty.
+ */
+std::string DBLevelDB::getWorldTag() const
+{
+	DIR *dir = opendir(dbdir.c_str());
+	if (!dir)
+		throw std::runtime_error("Failed to list database directory");
+	std::vector<std::string> entries;
+	uint64_t logSize = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		std::string name(ent->d_name);
+		size_t dot = name.rfind('.');
+		std::string ext = dot == std::string::npos ? "" : name.substr(dot);
+		if (ext != ".ldb" && ext != ".sst" && ext != ".log")
 			continue;
-		for (auto pos2 : it.second) {
-			if (pos2.first < min.x || pos2.first >= max.x)
-				continue;
-			if (pos2.second < min.y || pos2.second >= max.y)
-				continue;
-			res.emplace_back(pos2.first, pos2.second, it.first);
-		}
+		struct stat st;
+		if (stat((dbdir + PATH_SEPARATOR + name).c_str(), &st) != 0)
+			continue;
+		if (ext == ".log")
+			logSize += st.st_size;
+		else
+			entries.push_back(name + ":" + std::to_string(st.st_size));
 	}
-	return res;
+	closedir(dir);
+	std::sort(entries.begin(), entries.end());
+
+	uint64_t h = 14695981039346656037ULL; // FNV-1a
+	for (const auto &e : entries) {
+		for (char c : e)
+			h = (h ^ (u8) c) * 1099511628211ULL;
+		h = (h ^ '/') * 1099511628211ULL;
+	}
+	return "leveldb " + std::to_string(entries.size()) + " " +
+		std::to_string(h) + " " + std::to_string(logSize);
 }
 
 
 void DBLevelDB::loadPosCache()
 {
+	Trace::Span span(m_trace, "list blocks", "db");
 	leveldb::Iterator * it = db->NewIterator(leveldb::ReadOptions());
 	for (it->SeekToFirst(); it->Valid(); it->Next()) {
-		int64_t posHash = stoi64(it->key().ToString());
+		int64_t posHash;
+		if (!stoi64(it->key(), posHash))
+			continue;
+		posCache.add(decodeBlockPos(posHash));
+	}
+	delete it;
+	posCache.finalize();
+}
+
+
+// rowSizes is indexed by Z + 2048
+void DBLevelDB::planBands(const std::vector<size_t> &rowSizes)
+{
+	bandOf.assign(4096, -1);
+	int band = 0;
+	size_t bandSize = 0;
+	for (int z = scanMax.z - 1; z >= scanMin.z; z--) {
+		size_t rowSize = rowSizes[z + 2048];
+		if (rowSize == 0)
+			continue;
+		if (bandSize > 0 && bandSize + rowSize > memoryBudget) {
+			band++;
+			bandSize = 0;
+		}
+		bandOf[z + 2048] = band;
+		bandSize += rowSize;
+	}
+	spillFiles.assign(band + 1, nullptr);
+#ifndef NDEBUG
+	std::cerr << "Sequential scan: " << (band + 1) << " band(s)" << std::endl;
+#endif
+}
+
+
+/* Keys are sorted as strings, which has nothing to do with the order we
+ * render in. So read everything in one go, keep the band that is needed
+ * first in memory and write the rest out to be read back later.
+ * How big the bands are is only known at the end, so as long as everything
+ * fits into the memory budget it's simply kept. Otherwise the blocks go to
+ * a temporary file first, which is then split into bands.
+ */
+void DBLevelDB::scanAll(bool buildIndex)
+{
+	Trace::Span span(m_trace, "scan database", "db");
+	scanned = true;
+	currentBand = 0;
+	blockCache.clear();
+	std::vector<size_t> rowSizes(4096);
+	size_t inMemory = 0;
+	FILE *unsorted = nullptr;
+
+	leveldb::ReadOptions options;
+	options.fill_cache = false;
+	options.snapshot = db->GetSnapshot();
+	leveldb::Iterator *it = db->NewIterator(options);
+	for (it->SeekToFirst(); it->Valid(); it->Next()) {
+		int64_t posHash;
+		if (!stoi64(it->key(), posHash))
+			continue;
 		BlockPos pos = decodeBlockPos(posHash);
+		if (buildIndex)
+			posCache.add(pos);
+		if (pos.x < scanMin.x || pos.x >= scanMax.x ||
+			pos.y < scanMin.y || pos.y >= scanMax.y ||
+			pos.z < scanMin.z || pos.z >= scanMax.z)
+			continue;
 
-		posCache[pos.z].emplace_back(pos.x, pos.y);
+		leveldb::Slice data = it->value();
+		rowSizes[pos.z + 2048] += data.size();
+		if (unsorted) {
+			spill(unsorted, pos, (const u8 *) data.data(), data.size());
+			continue;
+		}
+		blockCache[pos.z][pos.x].emplace_back(
+			pos, ustring((unsigned char *) data.data(), data.size())
+		);
+		inMemory += data.size();
+		if (inMemory > memoryBudget) {
+			for (const auto &row : blockCache) {
+				for (const auto &column : row.second) {
+					for (const auto &block : column.second)
+						spill(unsorted, block.first, block.second.data(), block.second.size());
+				}
+			}
+			blockCache.clear();
+		}
 	}
+	leveldb::Status status = it->status();
 	delete it;
+	db->ReleaseSnapshot(options.snapshot);
+	if (buildIndex)
+		posCache.finalize();
+	if (!status.ok()) {
+		if (unsorted)
+			fclose(unsorted);
+		throw std::runtime_error(std::string("Failed to read Database: ") + status.ToString());
+	}
+
+	planBands(rowSizes);
+	if (unsorted) {
+		// distribute the blocks over the bands
+		readSpilled(unsorted, [&] (BlockPos pos, const ustring &data) {
+			int band = bandOf[pos.z + 2048];
+			if (band == 0)
+				blockCache[pos.z][pos.x].emplace_back(pos, data);
+			else
+				spill(spillFiles[band], pos, data.data(), data.size());
+		});
+	}
+	sortBlockCache();
+}
+
+
+// from the top down, like the renderer visits the columns
+void DBLevelDB::sortBlockCache()
+{
+	for (auto &row : blockCache) {
+		for (auto &column : row.second)
+			column.second.sort();
+	}
+}
+
+
+void DBLevelDB::spill(FILE *&f, BlockPos pos, const u8 *data, size_t size)
+{
+	if (!f && !(f = tmpfile()))
+		throw std::runtime_error("Failed to create temporary file");
+	int16_t header[3] = { pos.x, pos.y, pos.z };
+	uint32_t size32 = size;
+	if (fwrite(header, sizeof(header), 1, f) != 1 ||
+		fwrite(&size32, sizeof(size32), 1, f) != 1 ||
+		fwrite(data, 1, size, f) != size)
+		throw std::runtime_error("Failed to write temporary file");
+}
+
+
+void DBLevelDB::loadSpilledBand(int band)
+{
+	Trace::Span span(m_trace, "load band", "db");
+	blockCache.clear();
+	currentBand = band;
+	FILE *f = spillFiles[band];
+	if (!f)
+		return; // nothing in it
+	spillFiles[band] = nullptr;
+
+	readSpilled(f, [&] (BlockPos pos, const ustring &data) {
+		blockCache[pos.z][pos.x].emplace_back(pos, data);
+	});
+	sortBlockCache();
+}
+
+
+// reads a file written by spill() and closes it
+void DBLevelDB::readSpilled(FILE *f,
+		const std::function<void(BlockPos, const ustring&)> &cb)
+{
+	rewind(f);
+	int16_t header[3];
+	uint32_t size;
+	ustring data;
+	try {
+		while (fread(header, sizeof(header), 1, f) == 1) {
+			if (fread(&size, sizeof(size), 1, f) != 1)
+				break;
+			data.resize(size);
+			if (fread(&data[0], 1, size, f) != size)
+				break;
+			cb(BlockPos(header[0], header[1], header[2]), data);
+		}
+	} catch (...) {
+		fclose(f);
+		throw;
+	}
+	bool error = ferror(f) || !feof(f);
+	fclose(f);
+	if (error)
+		throw std::runtime_error("Failed to read temporary file");
+}
+
+
+/* Returns the blocks of a column from the scan, or nullptr if the column
+ * has to be read block by block: it is outside of the area that was
+ * scanned, or its band was already thrown away.
+ */
+const BlockList *DBLevelDB::getScannedColumn(int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y)
+{
+	static const BlockList empty;
+	if (!sequential)
+		return nullptr;
+	if (!scanned) {
+		setScanArea(BlockPos(-2048, min_y, -2048), BlockPos(2048, max_y, 2048));
+		ensurePosCache();
+		if (!scanned) // (posCache was loaded from indexFile)
+			scanAll(false);
+	}
+	if (x < scanMin.x || x >= scanMax.x || z < scanMin.z || z >= scanMax.z ||
+			min_y < scanMin.y || max_y > scanMax.y)
+		return nullptr;
+
+	int band = bandOf[z + 2048];
+	if (band < 0)
+		return &empty; // no blocks in this row
+	if (band < currentBand)
+		return nullptr;
+	if (band != currentBand)
+		loadSpilledBand(band);
+
+	auto row = blockCache.find(z);
+	if (row == blockCache.end())
+		return &empty;
+	auto it = row->second.find(x);
+	if (it == row->second.end())
+		return &empty;
+	return &it->second;
 }
 
 
 void DBLevelDB::getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
 		int16_t min_y, int16_t max_y)
 {
+	if (const BlockList *column = getScannedColumn(x, z, min_y, max_y)) {
+		// copied, a column can be asked for more than once
+		for (const auto &block : *column) {
+			if (block.first.y >= min_y && block.first.y < max_y)
+				blocks.push_back(block);
+		}
+		return;
+	}
+
 	std::string datastr;
 	leveldb::Status status;
 
-	auto it = posCache.find(z);
-	if (it == posCache.cend())
-		return;
-	for (auto pos2 : it->second) {
-		if (pos2.first != x)
-			continue;
-		if (pos2.second < min_y || pos2.second >= max_y)
+	ensurePosCache();
+	auto ys = posCache.column(x, z);
+	for (auto y = ys.first; y != ys.second; y++) {
+		if (*y < min_y || *y >= max_y)
 			continue;
 
-		BlockPos pos(x, pos2.second, z);
-		status = db->Get(leveldb::ReadOptions(), i64tos(encodeBlockPos(pos)), &datastr);
+		BlockPos pos(x, *y, z);
+		status = db->Get(readOptions, std::to_string(encodeBlockPos(pos)), &datastr);
 		if (status.ok()) {
 			blocks.emplace_back(
 				pos, ustring((unsigned char *) datastr.data(), datastr.size())
@@ -97,6 +423,43 @@ void DBLevelDB::getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
 	}
 }
 
+
+void DBLevelDB::visitBlocksOnXZ(int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb)
+{
+	if (const BlockList *column = getScannedColumn(x, z, min_y, max_y)) {
+		for (const auto &block : *column) {
+			if (block.first.y >= max_y)
+				continue;
+			if (block.first.y < min_y)
+				break;
+			if (!cb(block.first, block.second.data(), block.second.size()))
+				break;
+		}
+		return;
+	}
+
+	std::string datastr;
+	leveldb::Status status;
+
+	ensurePosCache();
+	auto ys = posCache.column(x, z);
+	for (auto y = ys.second; y != ys.first; ) {
+		--y;
+		if (*y >= max_y)
+			continue;
+		if (*y < min_y)
+			break;
+
+		BlockPos pos(x, *y, z);
+		status = db->Get(readOptions, std::to_string(encodeBlockPos(pos)), &datastr);
+		if (status.ok()) {
+			if (!cb(pos, (const u8 *) datastr.data(), datastr.size()))
+				break;
+		}
+	}
+}
+
 void DBLevelDB::getBlocksByPos(BlockList &blocks,
 			const std::vector<BlockPos> &positions)
 {
@@ -104,7 +467,7 @@ void DBLevelDB::getBlocksByPos(BlockList &blocks,
 	leveldb::Status status;
 
 	for (auto pos : positions) {
-		status = db->Get(leveldb::ReadOptions(), i64tos(encodeBlockPos(pos)), &datastr);
+		status = db->Get(readOptions, std::to_string(encodeBlockPos(pos)), &datastr);
 		if (status.ok()) {
 			blocks.emplace_back(
 				pos, ustring((unsigned char *) datastr.data(), datastr.size())
@@ -112,3 +475,18 @@ void DBLevelDB::getBlocksByPos(BlockList &blocks,
 		}
 	}
 }
+
+void DBLevelDB::visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb)
+{
+	std::string datastr;
+	leveldb::Status status;
+
+	for (auto pos : positions) {
+		status = db->Get(readOptions, std::to_string(encodeBlockPos(pos)), &datastr);
+		if (status.ok()) {
+			if (!cb(pos, (const u8 *) datastr.data(), datastr.size()))
+				break;
+		}
+	}
+}
@@ -2,13 +2,22 @@
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <algorithm>
+#include <climits>
+#include <memory>
 #include <arpa/inet.h>
 #include "db-postgresql.h"
+#include "Trace.h"
 #include "util.h"
 #include "types.h"
 
 #define ARRLEN(x) (sizeof(x) / sizeof((x)[0]))
 
+struct ResultDeleter {
+	void operator()(PGresult *res) const { PQclear(res); }
+};
+typedef std::unique_ptr<PGresult, ResultDeleter> ResultPtr;
+
 DBPostgreSQL::DBPostgreSQL(const std::string &mapdir)
 {
 	std::ifstream ifs(mapdir + "world.mt");
@@ -33,10 +42,30 @@ DBPostgreSQL::DBPostgreSQL(const std::string &mapdir)
 		" (posZ BETWEEN $5::int4 AND $6::int4)"
 	);
 	prepareStatement(
-		"get_blocks",
-		"SELECT posY::int4, data FROM blocks WHERE"
-		" posX = $1::int4 AND posZ = $2::int4"
-		" AND (posY BETWEEN $3::int4 AND $4::int4)"
+		"get_extent",
+		"SELECT MIN(posX)::int4, MIN(posY)::int4, MIN(posZ)::int4,"
+		" MAX(posX)::int4, MAX(posY)::int4, MAX(posZ)::int4 FROM blocks WHERE"
+		" (posX BETWEEN $1::int4 AND $2::int4) AND"
+		" (posY BETWEEN $3::int4 AND $4::int4) AND"
+		" (posZ BETWEEN $5::int4 AND $6::int4)"
+	);
+	prepareStatement(
+		"get_blocks_range",
+		"SELECT posX::int4, posY::int4, data FROM blocks WHERE"
+		" posZ = $1::int4"
+		" AND (posX BETWEEN $2::int4 AND $3::int4)"
+		" AND (posY BETWEEN $4::int4 AND $5::int4)"
+	);
+	prepareStatement(
+		"get_changed_pos",
+		// extend the 32-bit xmin to a 64-bit txid using the current epoch
+		"SELECT posX::int4, posY::int4, posZ::int4 FROM blocks,"
+		" (SELECT txid_snapshot_xmax(txid_current_snapshot()) AS cur) s"
+		" WHERE NOT txid_visible_in_snapshot("
+		"  ((s.cur >> 32) << 32) + xmin::text::int8 -"
+		"  CASE WHEN ((s.cur >> 32) << 32) + xmin::text::int8 > s.cur"
+		"  THEN 4294967296 ELSE 0 END,"
+		" $1::text::txid_snapshot)"
 	);
 	prepareStatement(
 		"get_block_exact",
@@ -52,6 +81,8 @@ DBPostgreSQL::DBPostgreSQL(const std::string &mapdir)
 DBPostgreSQL::~DBPostgreSQL()
 {
 	try {
+		closeCursor();
+		drainPipeline();
 		checkResults(PQexec(db, "COMMIT;"));
 	} catch (const std::exception& caught) {
 		std::cerr << "could not finalize: " << caught.what() << std::endl;
@@ -60,8 +91,29 @@ DBPostgreSQL::~DBPostgreSQL()
 }
 
 
+bool DBPostgreSQL::setOption(const std::string &name, const std::string &value)
+{
+	if (name == "pipeline_depth") {
+		pipelineDepth = atoi(value.c_str());
+		if (pipelineDepth < 1)
+			throw std::runtime_error("pipeline_depth needs to be 1 or higher");
+		return true;
+	} else if (name == "cursor_batch") {
+		cursorBatch = atoi(value.c_str());
+		if (cursorBatch < 0)
+			throw std::runtime_error("cursor_batch needs to be 0 or higher");
+		return true;
+	}
+	return false;
+}
+
+
 std::vector<BlockPos> DBPostgreSQL::getBlockPos(BlockPos min, BlockPos max)
 {
+	Trace::Span span(m_trace, "list blocks", "db");
+	closeCursor();
+	drainPipeline();
+
 	int32_t const x1 = htonl(min.x);
 	int32_t const x2 = htonl(max.x - 1);
 	int32_t const y1 = htonl(min.y);
@@ -78,6 +130,8 @@ std::vector<BlockPos> DBPostgreSQL::getBlockPos(BlockPos min, BlockPos max)
 		argLen, argFmt, false
 	);
 
+	setRange(min, max);
+
 	int numrows = PQntuples(results);
 
 	std::vector<BlockPos> positions;
@@ -88,52 +142,576 @@ std::vector<BlockPos> DBPostgreSQL::getBlockPos(BlockPos min, BlockPos max)
 
 	PQclear(results);
 
+	// The renderer will go through these rows from top to bottom
+	rowQueue.clear();
+	for (auto pos : positions)
+		rowQueue.push_back(pos.z);
+	std::sort(rowQueue.begin(), rowQueue.end(), std::greater<int16_t>());
+	rowQueue.erase(std::unique(rowQueue.begin(), rowQueue.end()), rowQueue.end());
+	rowQueueNext = rowQueueSent = 0;
+
 	return positions;
 }
 
 
-void DBPostgreSQL::getBlocksOnXZ(BlockList &blocks, int16_t xPos, int16_t zPos,
+/* The cursor of cursor_batch is used for the positions as well, so that
+ * they don't all have to be held in memory for big renders.
+ */
+void DBPostgreSQL::visitBlockPos(BlockPos min, BlockPos max,
+		const std::function<void(BlockPos)> &cb)
+{
+	if (cursorBatch < 1) {
+		DB::visitBlockPos(min, max, cb);
+		return;
+	}
+
+	Trace::Span span(m_trace, "list blocks", "db");
+	closeCursor();
+	drainPipeline();
+
+	int32_t const x1 = htonl(min.x);
+	int32_t const x2 = htonl(max.x - 1);
+	int32_t const y1 = htonl(min.y);
+	int32_t const y2 = htonl(max.y - 1);
+	int32_t const z1 = htonl(min.z);
+	int32_t const z2 = htonl(max.z - 1);
+
+	const void *args[] = { &x1, &x2, &y1, &y2, &z1, &z2 };
+	const int argLen[] = { 4, 4, 4, 4, 4, 4 };
+	const int argFmt[] = { 1, 1, 1, 1, 1, 1 };
+
+	checkResults(PQexecParams(db,
+		"DECLARE mapper_positions BINARY NO SCROLL CURSOR FOR"
+		" SELECT posX::int4, posY::int4, posZ::int4 FROM blocks WHERE"
+		" (posX BETWEEN $1::int4 AND $2::int4) AND"
+		" (posY BETWEEN $3::int4 AND $4::int4) AND"
+		" (posZ BETWEEN $5::int4 AND $6::int4)",
+		ARRLEN(args), NULL, (const char* const*) args, argLen, argFmt, 1
+	));
+
+	setRange(min, max);
+
+	std::vector<bool> rows(4096);
+	const std::string query = "FETCH " + std::to_string(cursorBatch) + " FROM mapper_positions";
+	int numrows;
+	do {
+		PGresult *results = checkResults(PQexec(db, query.c_str()), false);
+		numrows = PQntuples(results);
+		try {
+			for (int row = 0; row < numrows; ++row) {
+				BlockPos pos = pg_to_blockpos(results, row, 0);
+				rows[pos.z + 2048] = true;
+				cb(pos);
+			}
+		} catch (...) {
+			PQclear(results);
+			checkResults(PQexec(db, "CLOSE mapper_positions;"));
+			throw;
+		}
+		PQclear(results);
+	} while (numrows == cursorBatch);
+	checkResults(PQexec(db, "CLOSE mapper_positions;"));
+
+	// The renderer will go through these rows from top to bottom
+	rowQueue.clear();
+	for (int z = 4095; z >= 0; z--) {
+		if (rows[z])
+			rowQueue.push_back(z - 2048);
+	}
+	rowQueueNext = rowQueueSent = 0;
+}
+
+
+// Remember the range so fetching whole rows doesn't load too much
+void DBPostgreSQL::setRange(BlockPos min, BlockPos max)
+{
+	cacheMinX = min.x;
+	cacheMaxX = max.x;
+	cacheMinZ = min.z;
+	cacheMaxZ = max.z;
+	blockCachedZ = -10000;
+}
+
+
+void DBPostgreSQL::prefetchRow(int16_t z, const std::vector<int16_t> &xs,
 		int16_t min_y, int16_t max_y)
 {
-	int32_t const x = htonl(xPos);
-	int32_t const z = htonl(zPos);
-	int32_t const y1 = htonl(min_y);
-	int32_t const y2 = htonl(max_y - 1);
+	if (xs.empty())
+		return;
+	rowHintZ = z;
+	rowHintMinX = *std::min_element(xs.begin(), xs.end());
+	rowHintMaxX = *std::max_element(xs.begin(), xs.end()) + 1;
+}
+
+
+/* Which part of row zPos to read so that column xPos is included. Other
+ * renders sharing the database can have made the last position query, so
+ * its range can't be relied upon to contain the column.
+ */
+void DBPostgreSQL::getRowRange(int16_t xPos, int16_t zPos,
+		int16_t &min_x, int16_t &max_x)
+{
+	if (zPos == rowHintZ && xPos >= rowHintMinX && xPos < rowHintMaxX) {
+		min_x = rowHintMinX;
+		max_x = rowHintMaxX;
+	} else if (zPos >= cacheMinZ && zPos < cacheMaxZ &&
+			xPos >= cacheMinX && xPos < cacheMaxX) {
+		min_x = cacheMinX;
+		max_x = cacheMaxX;
+	} else {
+		min_x = xPos;
+		max_x = xPos + 1;
+	}
+}
+
+
+bool DBPostgreSQL::getExtent(BlockPos min, BlockPos max,
+		BlockPos &emin, BlockPos &emax)
+{
+	closeCursor();
+	drainPipeline();
 
-	const void *args[] = { &x, &z, &y1, &y2 };
-	const int argLen[] = { 4, 4, 4, 4 };
-	const int argFmt[] = { 1, 1, 1, 1 };
+	int32_t const x1 = htonl(min.x);
+	int32_t const x2 = htonl(max.x - 1);
+	int32_t const y1 = htonl(min.y);
+	int32_t const y2 = htonl(max.y - 1);
+	int32_t const z1 = htonl(min.z);
+	int32_t const z2 = htonl(max.z - 1);
+
+	const void *args[] = { &x1, &x2, &y1, &y2, &z1, &z2 };
+	const int argLen[] = { 4, 4, 4, 4, 4, 4 };
+	const int argFmt[] = { 1, 1, 1, 1, 1, 1 };
 
 	PGresult *results = execPrepared(
-		"get_blocks", ARRLEN(args), args,
+		"get_extent", ARRLEN(args), args,
 		argLen, argFmt, false
 	);
 
+	bool found = PQntuples(results) == 1 && !PQgetisnull(results, 0, 0);
+	if (found) {
+		emin = pg_to_blockpos(results, 0, 0);
+		emax = pg_to_blockpos(results, 0, 3);
+	}
+
+	PQclear(results);
+	return found;
+}
+
+
+PGresult *DBPostgreSQL::queryBlocksRange(int16_t zPos, int16_t min_x, int16_t max_x,
+		int16_t min_y, int16_t max_y, bool async)
+{
+	int32_t const z = htonl(zPos);
+	int32_t const x1 = htonl(min_x);
+	int32_t const x2 = htonl(max_x - 1);
+	int32_t const y1 = htonl(min_y);
+	int32_t const y2 = htonl(max_y - 1);
+
+	const void *args[] = { &z, &x1, &x2, &y1, &y2 };
+	const int argLen[] = { 4, 4, 4, 4, 4 };
+	const int argFmt[] = { 1, 1, 1, 1, 1 };
+
+	if (!async) {
+		return execPrepared(
+			"get_blocks_range", ARRLEN(args), args,
+			argLen, argFmt, false
+		);
+	}
+
+#ifdef LIBPQ_HAS_PIPELINING
+	if (!PQsendQueryPrepared(db, "get_blocks_range", ARRLEN(args),
+			(const char* const*) args, argLen, argFmt, 1 /* binary output */) ||
+			!PQpipelineSync(db)) {
+		throw std::runtime_error(std::string("PostgreSQL database error: ") +
+			PQerrorMessage(db));
+	}
+#endif
+	return nullptr;
+}
+
+
+/* With a network round trip for every row most of the time is spent waiting,
+ * so we keep the queries for the next few rows in flight.
+ */
+bool DBPostgreSQL::fetchPipelined(int16_t xPos, int16_t zPos, int16_t min_y, int16_t max_y)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+	// the queries cover the range of the position query the rows came from
+	if (pipelineDepth < 2 || rowQueueNext >= rowQueue.size() ||
+			rowQueue[rowQueueNext] != zPos ||
+			xPos < cacheMinX || xPos >= cacheMaxX) {
+		drainPipeline();
+		return false;
+	}
+	if (pipelineActive && (min_y != pipelineMinY || max_y != pipelineMaxY))
+		drainPipeline();
+
+	if (!pipelineActive) {
+		if (!PQenterPipelineMode(db))
+			return false;
+		pipelineActive = true;
+		pipelineMinY = min_y;
+		pipelineMaxY = max_y;
+		rowQueueSent = rowQueueNext;
+	}
+	while (rowQueueSent < rowQueue.size() &&
+			rowQueueSent - rowQueueNext < (size_t) pipelineDepth) {
+		queryBlocksRange(rowQueue[rowQueueSent++], cacheMinX, cacheMaxX,
+			min_y, max_y, true);
+	}
+
+	// every query is followed by its result, a terminator and the sync point
+	PGresult *results;
+	{
+		Trace::Span span(m_trace, "wait for row", "db");
+		results = PQgetResult(db);
+		while (PGresult *res = PQgetResult(db))
+			PQclear(res);
+		PQclear(PQgetResult(db));
+	}
+	rowQueueNext++;
+
+	loadBlockCache(zPos, cacheMinX, cacheMaxX, min_y, max_y,
+		checkResults(results, false));
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+void DBPostgreSQL::drainPipeline()
+{
+#ifdef LIBPQ_HAS_PIPELINING
+	if (!pipelineActive)
+		return;
+	// throw away results of the queries still in flight
+	for (; rowQueueSent > rowQueueNext; rowQueueSent--) {
+		while (PGresult *res = PQgetResult(db))
+			PQclear(res);
+		PQclear(PQgetResult(db));
+	}
+	PQexitPipelineMode(db);
+	pipelineActive = false;
+#endif
+}
+
+
+void DBPostgreSQL::loadBlockCache(int16_t zPos, int16_t min_x, int16_t max_x,
+		int16_t min_y, int16_t max_y, PGresult *results)
+{
+	Trace::Span span(m_trace, "load row", "db");
+	if (span.active())
+		span.setArgs("\"z\":" + std::to_string(zPos));
+	blockCache.clear();
+
+	if (!results)
+		results = queryBlocksRange(zPos, min_x, max_x, min_y, max_y);
+	ResultPtr guard(results);
+
 	int numrows = PQntuples(results);
 
 	for (int row = 0; row < numrows; ++row) {
 		BlockPos position;
-		position.x = xPos;
-		position.y = pg_binary_to_int(results, row, 0);
+		position.x = pg_binary_to_int(results, row, 0);
+		position.y = pg_binary_to_int(results, row, 1);
 		position.z = zPos;
-		blocks.emplace_back(
+		blockCache[position.x].emplace_back(
 			position,
 			ustring(
 				reinterpret_cast<unsigned char*>(
-					PQgetvalue(results, row, 1)
+					PQgetvalue(results, row, 2)
 				),
-				PQgetlength(results, row, 1)
+				PQgetlength(results, row, 2)
 			)
 		);
 	}
 
+	// from the top down, like the renderer visits them
+	for (auto &it : blockCache)
+		it.second.sort();
+
+	blockCachedZ = zPos;
+	blockCachedMinX = min_x;
+	blockCachedMaxX = max_x;
+	blockCachedMinY = min_y;
+	blockCachedMaxY = max_y;
+}
+
+
+/* For big renders it's cheaper to let the server sort everything once and
+ * stream it in the order the renderer asks for it. A cursor is used instead
+ * of COPY so that other queries can still be run in the meantime.
+ */
+bool DBPostgreSQL::fetchFromCursor(int16_t xPos, int16_t zPos,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb)
+{
+	// is column (z1, x1) visited before (z2, x2)?
+	auto before = [] (int z1, int x1, int z2, int x2) {
+		return z1 > z2 || (z1 == z2 && x1 > x2);
+	};
+
+	if (cursorBatch < 1)
+		return false;
+	if (cursorOpen && (min_y != cursorMinY || max_y != cursorMaxY))
+		closeCursor();
+	if (cursorOpen && before(zPos, xPos, cursorLastZ, cursorLastX))
+		return false; // can't go back
+	if (cursorOpen && (xPos < cursorMinX || xPos >= cursorMaxX ||
+			zPos < cursorMinZ || zPos >= cursorMaxZ))
+		return false; // not part of what the cursor reads
+
+	if (!cursorOpen) {
+		drainPipeline();
+
+		int32_t const x1 = htonl(cacheMinX);
+		int32_t const x2 = htonl(cacheMaxX - 1);
+		int32_t const y1 = htonl(min_y);
+		int32_t const y2 = htonl(max_y - 1);
+		int32_t const z1 = htonl(cacheMinZ);
+		int32_t const z2 = htonl(cacheMaxZ - 1);
+
+		const void *args[] = { &x1, &x2, &y1, &y2, &z1, &z2 };
+		const int argLen[] = { 4, 4, 4, 4, 4, 4 };
+		const int argFmt[] = { 1, 1, 1, 1, 1, 1 };
+
+		checkResults(PQexecParams(db,
+			"DECLARE mapper_blocks BINARY NO SCROLL CURSOR FOR"
+			" SELECT posX::int4, posY::int4, posZ::int4, data FROM blocks WHERE"
+			" (posX BETWEEN $1::int4 AND $2::int4) AND"
+			" (posY BETWEEN $3::int4 AND $4::int4) AND"
+			" (posZ BETWEEN $5::int4 AND $6::int4)"
+			" ORDER BY posZ DESC, posX DESC, posY DESC",
+			ARRLEN(args), NULL, (const char* const*) args, argLen, argFmt, 1
+		));
+		cursorOpen = true;
+		cursorDone = false;
+		cursorMinX = cacheMinX;
+		cursorMaxX = cacheMaxX;
+		cursorMinZ = cacheMinZ;
+		cursorMaxZ = cacheMaxZ;
+		cursorMinY = min_y;
+		cursorMaxY = max_y;
+	}
+	cursorLastX = xPos;
+	cursorLastZ = zPos;
+
+	while ((cursorResult && cursorRow < PQntuples(cursorResult)) || fetchCursorBatch()) {
+		BlockPos pos = pg_to_blockpos(cursorResult, cursorRow, 0);
+		if (before(pos.z, pos.x, zPos, xPos)) {
+			cursorRow++; // not requested by the renderer
+			continue;
+		}
+		if (pos.x != xPos || pos.z != zPos)
+			break;
+		// the rest of the column is skipped by the next call
+		const int row = cursorRow++;
+		if (!cb(pos, reinterpret_cast<const u8*>(PQgetvalue(cursorResult, row, 3)),
+				PQgetlength(cursorResult, row, 3)))
+			break;
+	}
+	return true;
+}
+
+
+bool DBPostgreSQL::fetchCursorBatch()
+{
+	if (cursorDone)
+		return false;
+	Trace::Span span(m_trace, "fetch from cursor", "db");
+	if (cursorResult)
+		PQclear(cursorResult);
+	std::string query = "FETCH " + std::to_string(cursorBatch) + " FROM mapper_blocks";
+	cursorResult = checkResults(PQexec(db, query.c_str()), false);
+	cursorRow = 0;
+	cursorDone = PQntuples(cursorResult) < cursorBatch;
+	return PQntuples(cursorResult) > 0;
+}
+
+
+void DBPostgreSQL::closeCursor()
+{
+	if (cursorResult) {
+		PQclear(cursorResult);
+		cursorResult = nullptr;
+	}
+	if (!cursorOpen)
+		return;
+	cursorOpen = false;
+	checkResults(PQexec(db, "CLOSE mapper_blocks;"));
+}
+
+
+/* Fetch the entire row of a column with one query and cache it between
+ * calls, this only works due to order in which the TileGenerator asks for
+ * blocks. Returns the cached blocks of the column or nullptr if it has none.
+ */
+BlockList *DBPostgreSQL::getCachedColumn(int16_t xPos, int16_t zPos,
+		int16_t min_y, int16_t max_y)
+{
+	int16_t min_x, max_x;
+	if (zPos != blockCachedZ || min_y != blockCachedMinY || max_y != blockCachedMaxY ||
+			xPos < blockCachedMinX || xPos >= blockCachedMaxX) {
+		if (!fetchPipelined(xPos, zPos, min_y, max_y)) {
+			getRowRange(xPos, zPos, min_x, max_x);
+			loadBlockCache(zPos, min_x, max_x, min_y, max_y);
+		}
+	}
+
+	auto it = blockCache.find(xPos);
+	if (it == blockCache.end())
+		return nullptr;
+
+	if (it->second.empty()) {
+		/* Same as in the sqlite3 backend, this is not supposed to happen. */
+#ifndef NDEBUG
+		std::cerr << "Warning: suboptimal access pattern for PostgreSQL backend" << std::endl;
+#endif
+		drainPipeline();
+		getRowRange(xPos, zPos, min_x, max_x);
+		loadBlockCache(zPos, min_x, max_x, min_y, max_y);
+		it = blockCache.find(xPos);
+		if (it == blockCache.end())
+			return nullptr;
+	}
+	return &it->second;
+}
+
+
+void DBPostgreSQL::getBlocksOnXZ(BlockList &blocks, int16_t xPos, int16_t zPos,
+		int16_t min_y, int16_t max_y)
+{
+	if (fetchFromCursor(xPos, zPos, min_y, max_y,
+			[&] (BlockPos pos, const u8 *data, size_t size) {
+				blocks.emplace_back(pos, ustring(data, size));
+				return true;
+			}))
+		return;
+
+	BlockList *column = getCachedColumn(xPos, zPos, min_y, max_y);
+	if (!column)
+		return;
+	// Swap lists to avoid copying contents
+	blocks.clear();
+	std::swap(blocks, *column);
+}
+
+
+/* Unlike getBlocksOnXZ the blocks stay where they are, so nothing is copied
+ * and a cached column can be visited again.
+ */
+void DBPostgreSQL::visitBlocksOnXZ(int16_t xPos, int16_t zPos,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb)
+{
+	if (fetchFromCursor(xPos, zPos, min_y, max_y, cb))
+		return;
+
+	BlockList *column = getCachedColumn(xPos, zPos, min_y, max_y);
+	if (!column)
+		return;
+	for (const auto &it : *column) {
+		if (!cb(it.first, it.second.data(), it.second.size()))
+			break;
+	}
+}
+
+
+/* Every row version carries the ID of the transaction that wrote it (xmin),
+ * so the snapshot of our transaction tells exactly which rows are new the
+ * next time. A new REPEATABLE READ transaction is started first, so that
+ * the render after this sees the map as of the token and a long running
+ * --serve doesn't keep its first snapshot (and old rows from VACUUM).
+ */
+std::string DBPostgreSQL::getChangeToken()
+{
+	closeCursor();
+	drainPipeline();
+
+	checkResults(PQexec(db, "COMMIT;"));
+	checkResults(PQexec(db, "START TRANSACTION;"));
+	checkResults(PQexec(db, "SET TRANSACTION ISOLATION LEVEL REPEATABLE READ;"));
+	PGresult *results = checkResults(
+		PQexec(db, "SELECT txid_current_snapshot()::text"), false);
+	std::string token;
+	if (PQntuples(results) > 0)
+		token = PQgetvalue(results, 0, 0);
 	PQclear(results);
+	return token;
+}
+
+
+/* The statistics count the rows written to the table, so unlike the snapshot
+ * they don't change with writes to the rest of the cluster. They are reported
+ * by the writing connection with a delay of about a second and can be reset,
+ * which only means a change is seen late or one more time.
+ */
+std::string DBPostgreSQL::getChangeHint()
+{
+	drainPipeline();
+	// otherwise the statistics would stay as of the first query in the transaction
+	checkResults(PQexec(db, "SELECT pg_stat_clear_snapshot();"));
+	PGresult *results = checkResults(PQexec(db,
+		"SELECT n_tup_ins, n_tup_upd, n_tup_del FROM pg_stat_user_tables"
+		" WHERE relid = 'blocks'::regclass"), false);
+	std::string hint;
+	if (PQntuples(results) > 0) {
+		hint = std::string(PQgetvalue(results, 0, 0)) + ":" +
+			PQgetvalue(results, 0, 1) + ":" + PQgetvalue(results, 0, 2);
+	}
+	PQclear(results);
+	return hint;
+}
+
+
+bool DBPostgreSQL::getChangedBlockPos(const std::string &token,
+		std::vector<BlockPos> &positions)
+{
+	// validate format (xmin:xmax:xip,...) so a bad cast doesn't abort the transaction
+	if (token.empty() || token.find_first_not_of("0123456789:,") != std::string::npos ||
+			std::count(token.begin(), token.end(), ':') != 2)
+		return false;
+
+	std::string current = getChangeToken();
+	if (current.empty())
+		return false;
+	// after 2^31 transactions the 32-bit xmin can't be compared anymore
+	int64_t then = strtoll(token.c_str() + token.find(':') + 1, nullptr, 10);
+	int64_t now = strtoll(current.c_str() + current.find(':') + 1, nullptr, 10);
+	if (then > now || now - then > INT32_MAX)
+		return false;
+
+	const void *args[] = { token.c_str() };
+
+	PGresult *results = execPrepared(
+		"get_changed_pos", ARRLEN(args), args,
+		nullptr, nullptr, false
+	);
+
+	int numrows = PQntuples(results);
+	positions.reserve(positions.size() + numrows);
+	for (int row = 0; row < numrows; ++row)
+		positions.emplace_back(pg_to_blockpos(results, row, 0));
+
+	PQclear(results);
+	return true;
 }
 
 
 void DBPostgreSQL::getBlocksByPos(BlockList &blocks,
 			const std::vector<BlockPos> &positions)
 {
+	visitBlocksByPos(positions, [&] (BlockPos pos, const u8 *data, size_t size) {
+		blocks.emplace_back(pos, ustring(data, size));
+		return true;
+	});
+}
+
+
+void DBPostgreSQL::visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb)
+{
+	drainPipeline();
+
 	int32_t x, y, z;
 
 	const void *args[] = { &x, &y, &z };
@@ -145,24 +723,24 @@ void DBPostgreSQL::getBlocksByPos(BlockList &blocks,
 		y = htonl(pos.y);
 		z = htonl(pos.z);
 
-		PGresult *results = execPrepared(
+		// (freed also when the visitor throws)
+		ResultPtr results(execPrepared(
 			"get_block_exact", ARRLEN(args), args,
 			argLen, argFmt, false
-		);
+		));
 
-		if (PQntuples(results) > 0) {
-			blocks.emplace_back(
+		bool more = true;
+		if (PQntuples(results.get()) > 0) {
+			more = cb(
 				pos,
-				ustring(
-					reinterpret_cast<unsigned char*>(
-						PQgetvalue(results, 0, 0)
-					),
-					PQgetlength(results, 0, 0)
-				)
+				reinterpret_cast<const u8*>(
+					PQgetvalue(results.get(), 0, 0)
+				),
+				PQgetlength(results.get(), 0, 0)
 			);
 		}
-
-		PQclear(results);
+		if (!more)
+			break;
 	}
 }
 
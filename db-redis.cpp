@@ -1,17 +1,48 @@
 #include <stdexcept>
 #include <sstream>
 #include <fstream>
+#include <deque>
+#include <memory>
+#include <algorithm>
 #include "db-redis.h"
+#include "Trace.h"
 #include "types.h"
 #include "util.h"
 
+// initial and maximum number of fields per HMGET
 #define DB_REDIS_HMGET_NUMFIELDS 30
+#define DB_REDIS_HMGET_MAXFIELDS 1000
+// batches are sized so that a reply is around this many bytes
+#define DB_REDIS_HMGET_TARGET_BYTES (256 * 1024)
+// number of blocks first asked for when reading a column top-down
+#define DB_REDIS_TOPDOWN_FIRST 4
+
+struct ReplyDeleter {
+	void operator()(redisReply *reply) const { freeReplyObject(reply); }
+};
 
 #define REPLY_TYPE_ERR(reply, desc) do { \
 	throw std::runtime_error(std::string("Unexpected type for " desc ": ") \
 			+ replyTypeStr((reply)->type)); \
 	} while(0)
 
+// parses a decimal number, returns false on garbage
+static inline bool atoi64(const char *s, size_t len, int64_t &out)
+{
+	bool neg = len > 0 && s[0] == '-';
+	size_t i = neg ? 1 : 0;
+	if (i == len || len > 20)
+		return false;
+	uint64_t u = 0;
+	for (; i < len; i++) {
+		if (s[i] < '0' || s[i] > '9')
+			return false;
+		u = u * 10 + (s[i] - '0');
+	}
+	out = neg ? -static_cast<int64_t>(u) : u;
+	return true;
+}
+
 static inline int64_t stoi64(const std::string &s)
 {
 	std::stringstream tmp(s);
@@ -20,15 +51,27 @@ static inline int64_t stoi64(const std::string &s)
 	return t;
 }
 
-static inline std::string i64tos(int64_t i)
+// writes decimal representation (without terminator), returns length
+static inline size_t i64toa(int64_t i, char *buf)
 {
-	std::ostringstream os;
-	os << i;
-	return os.str();
+	char tmp[20];
+	uint64_t u = i < 0 ? -static_cast<uint64_t>(i) : i;
+	size_t n = 0;
+	do {
+		tmp[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	size_t len = 0;
+	if (i < 0)
+		buf[len++] = '-';
+	while (n)
+		buf[len++] = tmp[--n];
+	return len;
 }
 
 
-DBRedis::DBRedis(const std::string &mapdir)
+DBRedis::DBRedis(const std::string &mapdir) :
+	batchSize(DB_REDIS_HMGET_NUMFIELDS)
 {
 	std::ifstream ifs(mapdir + "world.mt");
 	if (!ifs.good())
@@ -57,8 +100,8 @@ DBRedis::DBRedis(const std::string &mapdir)
 
 	/* Redis is just a key-value store, so the only optimization we can do
 	 * is to cache the block positions that exist in the db.
+	 * This happens on first use, since it's not always needed.
 	 */
-	loadPosCache();
 }
 
 
@@ -70,22 +113,22 @@ DBRedis::~DBRedis()
 
 std::vector<BlockPos> DBRedis::getBlockPos(BlockPos min, BlockPos max)
 {
+	ensurePosCache(min, max);
+
 	std::vector<BlockPos> res;
-	for (const auto &it : posCache) {
-		if (it.first < min.z || it.first >= max.z)
-			continue;
-		for (auto pos2 : it.second) {
-			if (pos2.first < min.x || pos2.first >= max.x)
-				continue;
-			if (pos2.second < min.y || pos2.second >= max.y)
-				continue;
-			res.emplace_back(pos2.first, pos2.second, it.first);
-		}
-	}
+	posCache.query(min, max, res);
 	return res;
 }
 
 
+bool DBRedis::getExtent(BlockPos min, BlockPos max,
+		BlockPos &emin, BlockPos &emax)
+{
+	ensurePosCache(min, max);
+	return posCache.extent(min, max, emin, emax);
+}
+
+
 const char *DBRedis::replyTypeStr(int type)
 {
 	switch (type) {
@@ -107,74 +150,218 @@ const char *DBRedis::replyTypeStr(int type)
 }
 
 
-void DBRedis::loadPosCache()
+void DBRedis::ensurePosCache(BlockPos min, BlockPos max)
+{
+	if (!posCacheLoaded && !indexFile.empty()) {
+		/* Redis has no cheap way to tell whether a hash changed, so only the
+		 * number of keys is compared. Overwriting a block doesn't move it,
+		 * but if blocks were deleted and as many others added since, the
+		 * saved positions are stale and index_file has to be removed. */
+		redisReply *reply = (redisReply*) redisCommand(ctx, "HLEN %s", hash.c_str());
+		if (!reply)
+			throw std::runtime_error("Redis command HLEN failed");
+		if (reply->type != REDIS_REPLY_INTEGER)
+			REPLY_TYPE_ERR(reply, "HLEN reply");
+		std::string tag = "redis " + hash + " " + std::to_string(reply->integer);
+		freeReplyObject(reply);
+
+		posCacheMin = BlockPos(-2048);
+		posCacheMax = BlockPos(2048);
+		posCacheLoaded = true;
+		if (!posCache.load(indexFile, tag)) {
+			loadPosCache(posCacheMin, posCacheMax);
+			posCache.save(indexFile, tag);
+		}
+		return;
+	}
+	if (posCacheLoaded) {
+		if (min.x >= posCacheMin.x && min.y >= posCacheMin.y && min.z >= posCacheMin.z &&
+			max.x <= posCacheMax.x && max.y <= posCacheMax.y && max.z <= posCacheMax.z)
+			return;
+		// outside of what we have, so just load everything
+		min = BlockPos(-2048);
+		max = BlockPos(2048);
+	}
+	loadPosCache(min, max);
+}
+
+
+void DBRedis::loadPosCache(BlockPos min, BlockPos max)
 {
-	redisReply *reply;
-	reply = (redisReply*) redisCommand(ctx, "HKEYS %s", hash.c_str());
+	Trace::Span span(m_trace, "list blocks", "db");
+	posCache.clear();
+	posCacheMin = min;
+	posCacheMax = max;
+	posCacheLoaded = true;
+
+	auto add = [&] (const redisReply *key) {
+		if (key->type != REDIS_REPLY_STRING)
+			REPLY_TYPE_ERR(key, "hash key");
+		int64_t posHash;
+		if (!atoi64(key->str, key->len, posHash))
+			throw std::runtime_error("Invalid key in redis hash");
+		BlockPos pos = decodeBlockPos(posHash);
+		if (pos.x < min.x || pos.x >= max.x || pos.y < min.y || pos.y >= max.y ||
+			pos.z < min.z || pos.z >= max.z)
+			return;
+		posCache.add(pos);
+	};
+
+	// (HSCAN may return keys more than once, finalize() takes care of that)
+	if (scanCount > 0) {
+		scanKeys(add);
+		posCache.finalize();
+		return;
+	}
+
+	std::unique_ptr<redisReply, ReplyDeleter> reply(
+		(redisReply*) redisCommand(ctx, "HKEYS %s", hash.c_str()));
 	if (!reply)
 		throw std::runtime_error("Redis command HKEYS failed");
 	if (reply->type != REDIS_REPLY_ARRAY)
 		REPLY_TYPE_ERR(reply, "HKEYS reply");
-	for (size_t i = 0; i < reply->elements; i++) {
-		if (reply->element[i]->type != REDIS_REPLY_STRING)
-			REPLY_TYPE_ERR(reply->element[i], "HKEYS subreply");
-		BlockPos pos = decodeBlockPos(stoi64(reply->element[i]->str));
-		posCache[pos.z].emplace_back(pos.x, pos.y);
+	for (size_t i = 0; i < reply->elements; i++)
+		add(reply->element[i]);
+
+	posCache.finalize();
+}
+
+
+/* HKEYS blocks the server for as long as it takes to produce a gigantic
+ * reply, HSCAN instead walks the hash in small steps.
+ * Servers before Redis 7.4 don't know NOVALUES, they are sent the values
+ * too, which are dropped here.
+ */
+void DBRedis::scanKeys(const std::function<void(const redisReply*)> &cb)
+{
+	std::string cursor = "0", count = std::to_string(scanCount);
+	bool first = true, noValues = true;
+	for (;;) {
+		const char *argv[] = {
+			"HSCAN", hash.c_str(), cursor.c_str(), "COUNT", count.c_str(), "NOVALUES"
+		};
+		std::unique_ptr<redisReply, ReplyDeleter> reply((redisReply*)
+			redisCommandArgv(ctx, noValues ? 6 : 5, argv, NULL));
+		if (!reply)
+			throw std::runtime_error("Redis command HSCAN failed");
+		if (first && noValues && reply->type == REDIS_REPLY_ERROR) {
+			noValues = false;
+			continue;
+		}
+		first = false;
+		if (reply->type != REDIS_REPLY_ARRAY)
+			REPLY_TYPE_ERR(reply, "HSCAN reply");
+		if (reply->elements != 2 || reply->element[0]->type != REDIS_REPLY_STRING ||
+				reply->element[1]->type != REDIS_REPLY_ARRAY)
+			throw std::runtime_error("HSCAN malformed reply");
+		const redisReply *keys = reply->element[1];
+		// without NOVALUES keys and values alternate
+		const size_t step = noValues ? 1 : 2;
+		for (size_t i = 0; i < keys->elements; i += step)
+			cb(keys->element[i]);
+		cursor.assign(reply->element[0]->str, reply->element[0]->len);
+		if (cursor == "0")
+			break;
 	}
+}
+
 
-	freeReplyObject(reply);
+bool DBRedis::setOption(const std::string &name, const std::string &value)
+{
+	if (name == "pipeline_depth") {
+		pipelineDepth = stoi64(value);
+		if (pipelineDepth < 1)
+			throw std::runtime_error("pipeline_depth needs to be 1 or higher");
+		return true;
+	} else if (name == "index_file") {
+		indexFile = value;
+		return true;
+	} else if (name == "scan_count") {
+		scanCount = stoi64(value);
+		return true;
+	}
+	return false;
 }
 
 
 void DBRedis::HMGET(const std::vector<BlockPos> &positions,
-	std::function<void(std::size_t, ustring)> result)
+	const std::function<bool(std::size_t, const u8 *, size_t)> &result)
 {
-	const char *argv[DB_REDIS_HMGET_NUMFIELDS + 2];
+	const char *argv[DB_REDIS_HMGET_MAXFIELDS + 2];
+	size_t argvlen[DB_REDIS_HMGET_MAXFIELDS + 2];
 	argv[0] = "HMGET";
+	argvlen[0] = 5;
 	argv[1] = hash.c_str();
+	argvlen[1] = hash.size();
+	char keys[DB_REDIS_HMGET_MAXFIELDS][24];
 
-	auto position = positions.begin();
-	size_t remaining = positions.size();
-	size_t abs_i = 0;
-	while (remaining > 0) {
-		const size_t batch_size = mymin<size_t>(DB_REDIS_HMGET_NUMFIELDS, remaining);
-
-		redisReply *reply;
-		{
-			// storage to preserve validity of .c_str()
-			std::string keys[batch_size];
-			for (size_t i = 0; i < batch_size; ++i) {
-				keys[i] = i64tos(encodeBlockPos(*position++));
-				argv[i+2] = keys[i].c_str();
+	/* Several commands are sent before reading the first reply, so the
+	 * network round trip is paid only once per pipelineDepth batches.
+	 * If the caller has seen enough, the replies in flight are still read
+	 * but nothing more is sent. */
+	std::deque<size_t> inflight; // sizes of sent batches
+	size_t sent = 0, abs_i = 0;
+	bool stopped = false;
+	try {
+		while (abs_i < sent || (!stopped && sent < positions.size())) {
+			while (!stopped && sent < positions.size() && inflight.size() < (size_t) pipelineDepth) {
+				const size_t batch_size = mymin<size_t>(batchSize, positions.size() - sent);
+				for (size_t i = 0; i < batch_size; ++i) {
+					argvlen[i+2] = i64toa(encodeBlockPos(positions[sent + i]), keys[i]);
+					argv[i+2] = keys[i];
+				}
+				if (redisAppendCommandArgv(ctx, batch_size + 2, argv, argvlen) != REDIS_OK)
+					throw std::runtime_error("Redis command HMGET failed");
+				inflight.push_back(batch_size);
+				sent += batch_size;
 			}
-			reply = (redisReply*) redisCommandArgv(ctx, batch_size + 2, argv, NULL);
-		}
 
-		if (!reply)
-			throw std::runtime_error("Redis command HMGET failed");
-		if (reply->type != REDIS_REPLY_ARRAY)
-			REPLY_TYPE_ERR(reply, "HMGET reply");
-		if (reply->elements != batch_size) {
-			freeReplyObject(reply);
-			throw std::runtime_error("HMGET wrong number of elements");
+			const size_t batch_size = inflight.front();
+
+			redisReply *r;
+			if (redisGetReply(ctx, reinterpret_cast<void**>(&r)) != REDIS_OK || !r)
+				throw std::runtime_error("Redis command HMGET failed");
+			inflight.pop_front();
+			std::unique_ptr<redisReply, ReplyDeleter> reply(r);
+			if (reply->type != REDIS_REPLY_ARRAY)
+				REPLY_TYPE_ERR(reply, "HMGET reply");
+			if (reply->elements != batch_size)
+				throw std::runtime_error("HMGET wrong number of elements");
+			size_t bytes = 0, found = 0;
+			for (size_t i = 0; i < reply->elements && !stopped; ++i) {
+				redisReply *subreply = reply->element[i];
+				if (subreply->type == REDIS_REPLY_NIL)
+					continue;
+				else if (subreply->type != REDIS_REPLY_STRING)
+					REPLY_TYPE_ERR(subreply, "HMGET subreply");
+				if (subreply->len == 0)
+					throw std::runtime_error("HMGET empty string");
+				stopped = !result(abs_i + i,
+					reinterpret_cast<const u8*>(subreply->str), subreply->len);
+				bytes += subreply->len;
+				found++;
+			}
+
+			// adapt batch size to the size of the blocks we're seeing
+			if (found > 0) {
+				size_t avg = mymax<size_t>(bytes / found, 1);
+				batchSize = mymin<size_t>(mymax<size_t>(DB_REDIS_HMGET_TARGET_BYTES / avg, 1),
+					DB_REDIS_HMGET_MAXFIELDS);
+			}
+
+			abs_i += batch_size;
 		}
-		for (size_t i = 0; i < reply->elements; ++i) {
-			redisReply *subreply = reply->element[i];
-			if (subreply->type == REDIS_REPLY_NIL)
-				continue;
-			else if (subreply->type != REDIS_REPLY_STRING)
-				REPLY_TYPE_ERR(subreply, "HMGET subreply");
-			if (subreply->len == 0)
-				throw std::runtime_error("HMGET empty string");
-			result(abs_i + i, ustring(
-				reinterpret_cast<const unsigned char*>(subreply->str),
-				subreply->len
-			));
+	} catch (...) {
+		/* The replies still in flight have to be read, or the next command
+		 * on this connection would get them instead of its own. */
+		while (!inflight.empty() && !ctx->err) {
+			void *r;
+			if (redisGetReply(ctx, &r) != REDIS_OK)
+				break;
+			freeReplyObject(r);
+			inflight.pop_front();
 		}
-		freeReplyObject(reply);
-
-		abs_i += batch_size;
-		remaining -= batch_size;
+		throw;
 	}
 }
 
@@ -182,25 +369,64 @@ void DBRedis::HMGET(const std::vector<BlockPos> &positions,
 void DBRedis::getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
 		int16_t min_y, int16_t max_y)
 {
-	auto it = posCache.find(z);
-	if (it == posCache.cend())
-		return;
+	std::vector<BlockPos> positions;
+	getColumnPos(x, z, min_y, max_y, positions);
+
+	getBlocksByPos(blocks, positions);
+}
+
 
+void DBRedis::visitBlocksOnXZ(int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb)
+{
 	std::vector<BlockPos> positions;
-	for (auto pos2 : it->second) {
-		if (pos2.first == x && pos2.second >= min_y && pos2.second < max_y)
-			positions.emplace_back(x, pos2.second, z);
+	getColumnPos(x, z, min_y, max_y, positions);
+	std::reverse(positions.begin(), positions.end());
+
+	/* Most columns are covered by their topmost blocks, so ask for a few
+	 * first and for more only if that wasn't enough. */
+	std::vector<BlockPos> batch;
+	size_t n = DB_REDIS_TOPDOWN_FIRST;
+	bool more = true;
+	for (auto it = positions.begin(); more && it != positions.end(); ) {
+		auto end = it + mymin<size_t>(n, positions.end() - it);
+		batch.assign(it, end);
+		it = end;
+		n *= 4;
+
+		HMGET(batch, [&] (std::size_t i, const u8 *data, size_t size) {
+			return more = cb(batch[i], data, size);
+		});
 	}
+}
 
-	getBlocksByPos(blocks, positions);
+
+void DBRedis::getColumnPos(int16_t x, int16_t z, int16_t min_y, int16_t max_y,
+		std::vector<BlockPos> &positions)
+{
+	// (not knowing which columns are next, don't load only this one)
+	if (!posCacheLoaded)
+		ensurePosCache(BlockPos(-2048), BlockPos(2048));
+	ensurePosCache(BlockPos(x, min_y, z), BlockPos(x + 1, max_y, z + 1));
+
+	posCache.query(BlockPos(x, min_y, z), BlockPos(x + 1, max_y, z + 1), positions);
 }
 
 
 void DBRedis::getBlocksByPos(BlockList &blocks,
 			const std::vector<BlockPos> &positions)
 {
-	auto result = [&] (std::size_t i, ustring data) {
-		blocks.emplace_back(positions[i], std::move(data));
-	};
-	HMGET(positions, result);
+	HMGET(positions, [&] (std::size_t i, const u8 *data, size_t size) {
+		blocks.emplace_back(positions[i], ustring(data, size));
+		return true;
+	});
+}
+
+
+void DBRedis::visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb)
+{
+	HMGET(positions, [&] (std::size_t i, const u8 *data, size_t size) {
+		return cb(positions[i], data, size);
+	});
 }
@@ -0,0 +1,216 @@
+#include <iostream>
+#include <set>
+#include "db-shared.h"
+#include "Trace.h"
+
+// rough overhead of a block in the list
+#define BLOCK_OVERHEAD 64
+
+
+DBShared::DBShared(DB *db, size_t cacheSize) :
+	m_db(db), m_cacheSize(0), m_cacheLimit(cacheSize)
+{
+}
+
+
+DBShared::~DBShared()
+{
+#ifndef NDEBUG
+	std::cerr << "Shared column cache: " << m_hits << " hits, "
+		<< m_misses << " misses" << std::endl;
+#endif
+	delete m_db;
+}
+
+
+std::vector<BlockPos> DBShared::getBlockPos(BlockPos min, BlockPos max)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_db->getBlockPos(min, max);
+}
+
+
+void DBShared::visitBlockPos(BlockPos min, BlockPos max,
+		const std::function<void(BlockPos)> &cb)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_db->visitBlockPos(min, max, cb);
+}
+
+
+bool DBShared::getExtent(BlockPos min, BlockPos max,
+		BlockPos &emin, BlockPos &emax)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_db->getExtent(min, max, emin, emax);
+}
+
+
+// the database may be busy with other renders
+std::unique_lock<std::mutex> DBShared::lock()
+{
+	Trace::Span span(m_trace, "wait for database", "db", true);
+	return std::unique_lock<std::mutex>(m_mutex);
+}
+
+
+DBShared::Column DBShared::findColumn(uint64_t key)
+{
+	auto it = m_columns.find(key);
+	if (it == m_columns.end())
+		return Column();
+	m_lru.splice(m_lru.begin(), m_lru, it->second);
+	return it->second->blocks;
+}
+
+
+DBShared::Column DBShared::fetchColumn(uint64_t key, int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y)
+{
+#ifndef NDEBUG
+	m_misses++;
+#endif
+	BlockList *blocks = new BlockList();
+	Column column(blocks);
+	m_db->getBlocksOnXZ(*blocks, x, z, min_y, max_y);
+	blocks->sort();
+
+	size_t size = sizeof(CacheEntry);
+	for (const auto &it : *blocks)
+		size += it.second.size() + BLOCK_OVERHEAD;
+	m_lru.push_front(CacheEntry{key, column, size});
+	m_columns[key] = m_lru.begin();
+	m_cacheSize += size;
+
+	// renders still holding on to evicted columns keep them alive
+	while (m_cacheSize > m_cacheLimit && !m_lru.empty()) {
+		const CacheEntry &last = m_lru.back();
+		m_cacheSize -= last.size;
+		m_columns.erase(last.key);
+		m_lru.pop_back();
+	}
+	return column;
+}
+
+
+void DBShared::getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y)
+{
+	visitBlocksOnXZ(x, z, min_y, max_y, [&] (BlockPos pos, const u8 *data, size_t size) {
+		blocks.emplace_back(pos, ustring(data, size));
+		return true;
+	});
+}
+
+
+void DBShared::visitBlocksOnXZ(int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb)
+{
+	const uint64_t key = columnKey(x, z, min_y, max_y);
+	Column column;
+	{
+		auto locked = lock();
+		column = findColumn(key);
+#ifndef NDEBUG
+		if (column)
+			m_hits++;
+#endif
+		if (!column)
+			column = fetchColumn(key, x, z, min_y, max_y);
+	}
+	for (const auto &it : *column) {
+		if (!cb(it.first, it.second.data(), it.second.size()))
+			break;
+	}
+}
+
+
+void DBShared::getBlocksByPos(BlockList &blocks,
+		const std::vector<BlockPos> &positions)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_db->getBlocksByPos(blocks, positions);
+}
+
+
+/* Backends that cache a row at a time would start over every time a render
+ * asks for a column of a different row, so a row is read in one go.
+ */
+void DBShared::prefetchRow(int16_t z, const std::vector<int16_t> &xs,
+		int16_t min_y, int16_t max_y)
+{
+	auto locked = lock();
+	m_db->prefetchRow(z, xs, min_y, max_y);
+	if (m_cacheLimit == 0)
+		return;
+	Trace::Span span(m_trace, "prefetch row", "db");
+	size_t fetched = 0;
+	for (int16_t x : xs) {
+		const uint64_t key = columnKey(x, z, min_y, max_y);
+		if (m_columns.find(key) != m_columns.end())
+			continue;
+		fetchColumn(key, x, z, min_y, max_y);
+		fetched += m_lru.front().size;
+		// don't push out the start of the row before it was rendered
+		if (fetched > m_cacheLimit / 4)
+			break;
+	}
+}
+
+
+void DBShared::dropColumns(const std::vector<BlockPos> &positions)
+{
+	std::set<std::pair<int16_t, int16_t>> columns;
+	for (auto pos : positions)
+		columns.emplace(pos.x, pos.z);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto it = m_lru.begin(); it != m_lru.end(); ) {
+		const int16_t x = it->key >> 48, z = it->key >> 32;
+		if (columns.count(std::make_pair(x, z)) == 0) {
+			++it;
+			continue;
+		}
+		m_cacheSize -= it->size;
+		m_columns.erase(it->key);
+		it = m_lru.erase(it);
+	}
+}
+
+
+void DBShared::dropAll()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_lru.clear();
+	m_columns.clear();
+	m_cacheSize = 0;
+}
+
+
+bool DBShared::setOption(const std::string &name, const std::string &value)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_db->setOption(name, value);
+}
+
+
+std::string DBShared::getChangeToken()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_db->getChangeToken();
+}
+
+
+std::string DBShared::getChangeHint()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_db->getChangeHint();
+}
+
+
+bool DBShared::getChangedBlockPos(const std::string &token,
+		std::vector<BlockPos> &positions)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_db->getChangedBlockPos(token, positions);
+}
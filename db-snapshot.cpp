@@ -0,0 +1,321 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "db-snapshot.h"
+
+static const char snapshotMagic[8] = {'M', 'T', 'M', 'P', 'S', 'N', 'P', '1'};
+static const uint32_t snapshotBOM = 0x01020304;
+
+static inline bool columnBefore(const SnapshotColumn &c, int16_t z, int16_t x)
+{
+	return c.z < z || (c.z == z && c.x < x);
+}
+
+
+DBSnapshot::DBSnapshot(const std::string &path) :
+	m_data(nullptr), m_size(0)
+{
+#ifndef _WIN32
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw std::runtime_error("Failed to open snapshot");
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		m_size = st.st_size;
+		void *p = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED)
+			m_data = static_cast<const u8*>(p);
+	}
+	close(fd);
+#endif
+	if (!m_data) {
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f)
+			throw std::runtime_error("Failed to open snapshot");
+		u8 buf[65536];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+			m_buffer.insert(m_buffer.end(), buf, buf + n);
+		fclose(f);
+		m_data = m_buffer.data();
+		m_size = m_buffer.size();
+	}
+
+	SnapshotHeader hdr;
+	bool ok = m_size >= sizeof(hdr);
+	if (ok) {
+		memcpy(&hdr, m_data, sizeof(hdr));
+		ok = !memcmp(hdr.magic, snapshotMagic, sizeof(hdr.magic)) &&
+			hdr.bom == snapshotBOM &&
+			hdr.blocksOffset % 8 == 0 && hdr.columnsOffset % 8 == 0 &&
+			hdr.blocksOffset <= m_size && hdr.columnsOffset <= m_size &&
+			hdr.numBlocks <= (m_size - hdr.blocksOffset) / sizeof(SnapshotBlock) &&
+			hdr.numColumns <= (m_size - hdr.columnsOffset) / sizeof(SnapshotColumn);
+	}
+	if (!ok) {
+		unmap();
+		throw std::runtime_error("Not a valid snapshot file");
+	}
+	m_blocks = reinterpret_cast<const SnapshotBlock*>(m_data + hdr.blocksOffset);
+	m_columns = reinterpret_cast<const SnapshotColumn*>(m_data + hdr.columnsOffset);
+	m_numColumns = hdr.numColumns;
+
+	// lookups rely on the order, so check it along with the bounds
+	for (size_t i = 0; ok && i < m_numColumns; i++) {
+		const SnapshotColumn &col = m_columns[i];
+		if (i > 0 && !columnBefore(m_columns[i - 1], col.z, col.x))
+			ok = false;
+		if (col.first > hdr.numBlocks || col.count > hdr.numBlocks - col.first)
+			ok = false;
+		for (uint32_t j = 0; ok && j < col.count; j++) {
+			const SnapshotBlock &b = m_blocks[col.first + j];
+			ok = b.offset <= m_size && b.size <= m_size - b.offset &&
+				(j == 0 || b.y < m_blocks[col.first + j - 1].y);
+		}
+	}
+	if (!ok) {
+		unmap();
+		throw std::runtime_error("Snapshot file is corrupt");
+	}
+}
+
+
+DBSnapshot::~DBSnapshot()
+{
+	unmap();
+}
+
+
+void DBSnapshot::unmap()
+{
+#ifndef _WIN32
+	if (m_data && m_buffer.empty())
+		munmap(const_cast<u8*>(m_data), m_size);
+#endif
+	m_data = nullptr;
+}
+
+
+const SnapshotColumn *DBSnapshot::findColumn(int16_t x, int16_t z) const
+{
+	const SnapshotColumn *end = m_columns + m_numColumns;
+	const SnapshotColumn *it = std::lower_bound(m_columns, end, std::make_pair(z, x),
+		[] (const SnapshotColumn &c, const std::pair<int16_t, int16_t> &v) {
+			return columnBefore(c, v.first, v.second);
+		});
+	if (it == end || it->z != z || it->x != x)
+		return nullptr;
+	return it;
+}
+
+
+template<typename F>
+void DBSnapshot::forEachColumn(BlockPos min, BlockPos max, F cb) const
+{
+	const SnapshotColumn *end = m_columns + m_numColumns;
+	for (int z = min.z; z < max.z; z++) {
+		const SnapshotColumn *it = std::lower_bound(m_columns, end, std::make_pair(z, min.x),
+			[] (const SnapshotColumn &c, const std::pair<int, int16_t> &v) {
+				return columnBefore(c, v.first, v.second);
+			});
+		for (; it != end && it->z == z && it->x < max.x; it++) {
+			const SnapshotBlock *b = m_blocks + it->first;
+			const SnapshotBlock *b_end = b + it->count;
+			// Y descending
+			while (b != b_end && b->y >= max.y)
+				b++;
+			while (b_end != b && b_end[-1].y < min.y)
+				b_end--;
+			if (b != b_end)
+				cb(*it, b, b_end);
+		}
+	}
+}
+
+
+std::vector<BlockPos> DBSnapshot::getBlockPos(BlockPos min, BlockPos max)
+{
+	std::vector<BlockPos> positions;
+	forEachColumn(min, max, [&] (const SnapshotColumn &col,
+		const SnapshotBlock *b, const SnapshotBlock *b_end) {
+		for (; b != b_end; b++)
+			positions.emplace_back(col.x, b->y, col.z);
+	});
+	return positions;
+}
+
+
+bool DBSnapshot::getExtent(BlockPos min, BlockPos max,
+		BlockPos &emin, BlockPos &emax)
+{
+	bool found = false;
+	forEachColumn(min, max, [&] (const SnapshotColumn &col,
+		const SnapshotBlock *b, const SnapshotBlock *b_end) {
+		if (!found) {
+			emin = BlockPos(col.x, b_end[-1].y, col.z);
+			emax = BlockPos(col.x, b->y, col.z);
+			found = true;
+			return;
+		}
+		emin.x = std::min(emin.x, col.x);
+		emin.y = std::min(emin.y, b_end[-1].y);
+		emax.x = std::max(emax.x, col.x);
+		emax.y = std::max(emax.y, b->y);
+		emax.z = col.z;
+	});
+	return found;
+}
+
+
+void DBSnapshot::getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y)
+{
+	visitBlocksOnXZ(x, z, min_y, max_y, [&] (BlockPos pos, const u8 *data, size_t size) {
+		blocks.emplace_back(pos, ustring(data, size));
+		return true;
+	});
+}
+
+
+void DBSnapshot::visitBlocksOnXZ(int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb)
+{
+	const SnapshotColumn *col = findColumn(x, z);
+	if (!col)
+		return;
+	const SnapshotBlock *b = m_blocks + col->first;
+	for (const SnapshotBlock *end = b + col->count; b != end; b++) {
+		if (b->y >= max_y)
+			continue;
+		if (b->y < min_y)
+			break;
+		if (!cb(BlockPos(x, b->y, z), m_data + b->offset, b->size))
+			break;
+	}
+}
+
+
+void DBSnapshot::getBlocksByPos(BlockList &blocks,
+			const std::vector<BlockPos> &positions)
+{
+	visitBlocksByPos(positions, [&] (BlockPos pos, const u8 *data, size_t size) {
+		blocks.emplace_back(pos, ustring(data, size));
+		return true;
+	});
+}
+
+
+void DBSnapshot::visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb)
+{
+	const SnapshotColumn *col = nullptr;
+	for (auto pos : positions) {
+		if (!col || col->x != pos.x || col->z != pos.z)
+			col = findColumn(pos.x, pos.z);
+		if (!col)
+			continue;
+		const SnapshotBlock *begin = m_blocks + col->first;
+		const SnapshotBlock *b = std::lower_bound(begin, begin + col->count, pos.y,
+			[] (const SnapshotBlock &b, int16_t y) {
+				return b.y > y;
+			});
+		if (b == begin + col->count || b->y != pos.y)
+			continue;
+		if (!cb(pos, m_data + b->offset, b->size))
+			break;
+	}
+}
+
+
+SnapshotWriter::SnapshotWriter(const std::string &path) :
+	m_path(path), m_offset(0)
+{
+	m_file = fopen((m_path + ".tmp").c_str(), "wb");
+	if (!m_file)
+		throw std::runtime_error("Failed to write snapshot");
+	SnapshotHeader hdr = {};
+	write(&hdr, sizeof(hdr)); // filled in at the end
+}
+
+
+SnapshotWriter::~SnapshotWriter()
+{
+	if (m_file) {
+		fclose(m_file);
+		remove((m_path + ".tmp").c_str());
+	}
+}
+
+
+void SnapshotWriter::write(const void *data, size_t size)
+{
+	if (fwrite(data, 1, size, m_file) != size)
+		throw std::runtime_error("Failed to write snapshot");
+	m_offset += size;
+}
+
+
+void SnapshotWriter::align()
+{
+	const char pad[8] = {0};
+	write(pad, (8 - m_offset % 8) % 8);
+}
+
+
+void SnapshotWriter::addColumn(int16_t x, int16_t z)
+{
+	if (!m_columns.empty() && m_columns.back().count == 0)
+		m_columns.pop_back();
+	m_columns.push_back(SnapshotColumn{z, x, static_cast<uint32_t>(m_blocks.size()), 0});
+}
+
+
+void SnapshotWriter::addBlock(int16_t y, const u8 *data, size_t size)
+{
+	SnapshotColumn &col = m_columns.back();
+	if (col.count > 0 && m_blocks.back().y <= y)
+		throw std::logic_error("Blocks need to be added from the top down");
+	m_blocks.push_back(SnapshotBlock{y, 0, static_cast<uint32_t>(size), m_offset});
+	col.count++;
+	write(data, size);
+}
+
+
+void SnapshotWriter::finish()
+{
+	if (!m_columns.empty() && m_columns.back().count == 0)
+		m_columns.pop_back();
+	std::sort(m_columns.begin(), m_columns.end(),
+		[] (const SnapshotColumn &a, const SnapshotColumn &b) {
+			return columnBefore(a, b.z, b.x);
+		});
+
+	SnapshotHeader hdr;
+	memcpy(hdr.magic, snapshotMagic, sizeof(hdr.magic));
+	hdr.bom = snapshotBOM;
+	hdr.reserved = 0;
+	align();
+	hdr.numBlocks = m_blocks.size();
+	hdr.blocksOffset = m_offset;
+	write(m_blocks.data(), m_blocks.size() * sizeof(SnapshotBlock));
+	align();
+	hdr.numColumns = m_columns.size();
+	hdr.columnsOffset = m_offset;
+	write(m_columns.data(), m_columns.size() * sizeof(SnapshotColumn));
+
+	bool ok = fseek(m_file, 0, SEEK_SET) == 0 &&
+		fwrite(&hdr, sizeof(hdr), 1, m_file) == 1;
+	ok = fclose(m_file) == 0 && ok;
+	m_file = nullptr;
+	const std::string tmp = m_path + ".tmp";
+	if (!ok || rename(tmp.c_str(), m_path.c_str()) != 0) {
+		remove(tmp.c_str());
+		throw std::runtime_error("Failed to write snapshot");
+	}
+}
@@ -3,7 +3,9 @@
 #include <iostream>
 #include <algorithm>
 #include <time.h>
+#include <sstream>
 #include "db-sqlite3.h"
+#include "Trace.h"
 #include "types.h"
 
 #define SQLRES(f, good) \
@@ -13,6 +15,21 @@
 	}
 #define SQLOK(f) SQLRES(f, SQLITE_OK)
 
+/* Resets a statement when leaving the scope, so that it can be used again
+ * even when an exception (possibly from a visitor) got in the way.
+ */
+class StatementReset {
+public:
+	StatementReset(sqlite3_stmt *stmt) : m_stmt(stmt) {}
+	~StatementReset() { sqlite3_reset(m_stmt); }
+
+	StatementReset(const StatementReset&) = delete;
+	StatementReset& operator=(const StatementReset&) = delete;
+
+private:
+	sqlite3_stmt *m_stmt;
+};
+
 DBSQLite3::DBSQLite3(const std::string &mapdir)
 {
 	int result;
@@ -22,7 +39,7 @@ DBSQLite3::DBSQLite3(const std::string &mapdir)
 			SQLITE_OPEN_PRIVATECACHE, 0))
 
 	SQLOK(prepare_v2(db,
-			"SELECT pos, data FROM blocks WHERE pos BETWEEN ? AND ?",
+			"SELECT pos, data FROM blocks WHERE pos BETWEEN ? AND ? ORDER BY pos",
 		-1, &stmt_get_blocks_z, NULL))
 
 	SQLOK(prepare_v2(db,
@@ -36,6 +53,29 @@ DBSQLite3::DBSQLite3(const std::string &mapdir)
 	SQLOK(prepare_v2(db,
 			"SELECT pos FROM blocks WHERE pos BETWEEN ? AND ?",
 		-1, &stmt_get_block_pos_z, NULL))
+
+	// decodes the position hash like decodeBlockPos() does
+	SQLOK(prepare_v2(db,
+			"SELECT MIN(x), MIN(y), MIN(z), MAX(x), MAX(y), MAX(z) FROM ("
+			" SELECT x, y, (r - y) / 4096 AS z FROM ("
+			"  SELECT x, r, ((r % 4096) + 6144) % 4096 - 2048 AS y FROM ("
+			"   SELECT x, (pos - x) / 4096 AS r FROM ("
+			"    SELECT ((pos % 4096) + 6144) % 4096 - 2048 AS x, pos FROM blocks"
+			"    WHERE pos BETWEEN ?1 AND ?2)))"
+			") WHERE x BETWEEN ?3 AND ?4 AND y BETWEEN ?5 AND ?6 AND z BETWEEN ?7 AND ?8",
+		-1, &stmt_get_extent, NULL))
+
+	SQLOK(prepare_v2(db,
+			"SELECT rowid, pos FROM blocks ORDER BY rowid DESC LIMIT 1",
+		-1, &stmt_get_last_rowid, NULL))
+
+	SQLOK(prepare_v2(db,
+			"SELECT pos FROM blocks WHERE rowid = ?",
+		-1, &stmt_get_rowid_pos, NULL))
+
+	SQLOK(prepare_v2(db,
+			"SELECT pos FROM blocks WHERE rowid >= ?",
+		-1, &stmt_get_changed_pos, NULL))
 }
 
 
@@ -44,7 +84,11 @@ DBSQLite3::~DBSQLite3()
 	sqlite3_finalize(stmt_get_blocks_z);
 	sqlite3_finalize(stmt_get_block_pos);
 	sqlite3_finalize(stmt_get_block_pos_z);
+	sqlite3_finalize(stmt_get_extent);
 	sqlite3_finalize(stmt_get_block_exact);
+	sqlite3_finalize(stmt_get_last_rowid);
+	sqlite3_finalize(stmt_get_rowid_pos);
+	sqlite3_finalize(stmt_get_changed_pos);
 
 	if (sqlite3_close(db) != SQLITE_OK) {
 		std::cerr << "Error closing SQLite database." << std::endl;
@@ -68,6 +112,7 @@ inline void DBSQLite3::getPosRange(int64_t &min, int64_t &max, int16_t zPos,
 
 std::vector<BlockPos> DBSQLite3::getBlockPos(BlockPos min, BlockPos max)
 {
+	Trace::Span span(m_trace, "list blocks", "db");
 	int result;
 	sqlite3_stmt *stmt;
 
@@ -85,6 +130,10 @@ std::vector<BlockPos> DBSQLite3::getBlockPos(BlockPos min, BlockPos max)
 		SQLOK(bind_int64(stmt, 2, maxPos))
 	}
 
+	// whatever is cached may have been taken apart already
+	blockCachedZ = -10000;
+
+	StatementReset reset(stmt);
 	std::vector<BlockPos> positions;
 	while ((result = sqlite3_step(stmt)) != SQLITE_DONE) {
 		if (result == SQLITE_BUSY) { // Wait some time and try again
@@ -98,13 +147,53 @@ std::vector<BlockPos> DBSQLite3::getBlockPos(BlockPos min, BlockPos max)
 		if(pos.x >= min.x && pos.x < max.x && pos.y >= min.y && pos.y < max.y)
 			positions.emplace_back(pos);
 	}
-	SQLOK(reset(stmt));
 	return positions;
 }
 
 
+/* The X coordinate is in the lowest bits of the hash, so there is no way
+ * around looking at every key. But SQLite can do that on its own without
+ * handing each one to us.
+ */
+bool DBSQLite3::getExtent(BlockPos min, BlockPos max,
+		BlockPos &emin, BlockPos &emax)
+{
+	int result;
+	int64_t minPos, maxPos;
+	getPosRange(minPos, maxPos, std::max<int>(min.z, -2048), std::min<int>(max.z, 2048) - 1);
+	SQLOK(bind_int64(stmt_get_extent, 1, minPos))
+	SQLOK(bind_int64(stmt_get_extent, 2, maxPos))
+	SQLOK(bind_int(stmt_get_extent, 3, min.x))
+	SQLOK(bind_int(stmt_get_extent, 4, max.x - 1))
+	SQLOK(bind_int(stmt_get_extent, 5, min.y))
+	SQLOK(bind_int(stmt_get_extent, 6, max.y - 1))
+	SQLOK(bind_int(stmt_get_extent, 7, min.z))
+	SQLOK(bind_int(stmt_get_extent, 8, max.z - 1))
+
+	StatementReset reset(stmt_get_extent);
+	while ((result = sqlite3_step(stmt_get_extent)) == SQLITE_BUSY) {
+		usleep(10000); // Wait some time and try again
+	}
+	if (result != SQLITE_ROW)
+		throw std::runtime_error(sqlite3_errmsg(db));
+	bool found = sqlite3_column_type(stmt_get_extent, 0) != SQLITE_NULL;
+	if (found) {
+		emin = BlockPos(sqlite3_column_int(stmt_get_extent, 0),
+			sqlite3_column_int(stmt_get_extent, 1),
+			sqlite3_column_int(stmt_get_extent, 2));
+		emax = BlockPos(sqlite3_column_int(stmt_get_extent, 3),
+			sqlite3_column_int(stmt_get_extent, 4),
+			sqlite3_column_int(stmt_get_extent, 5));
+	}
+	return found;
+}
+
+
 void DBSQLite3::loadBlockCache(int16_t zPos)
 {
+	Trace::Span span(m_trace, "load row", "db");
+	if (span.active())
+		span.setArgs("\"z\":" + std::to_string(zPos));
 	int result;
 	blockCache.clear();
 
@@ -114,6 +203,7 @@ void DBSQLite3::loadBlockCache(int16_t zPos)
 	SQLOK(bind_int64(stmt_get_blocks_z, 1, minPos));
 	SQLOK(bind_int64(stmt_get_blocks_z, 2, maxPos));
 
+	StatementReset reset(stmt_get_blocks_z);
 	while ((result = sqlite3_step(stmt_get_blocks_z)) != SQLITE_DONE) {
 		if (result == SQLITE_BUSY) { // Wait some time and try again
 			usleep(10000);
@@ -128,7 +218,6 @@ void DBSQLite3::loadBlockCache(int16_t zPos)
 		size_t size = sqlite3_column_bytes(stmt_get_blocks_z, 1);
 		blockCache[pos.x].emplace_back(pos, ustring(data, size));
 	}
-	SQLOK(reset(stmt_get_blocks_z))
 }
 
 
@@ -154,6 +243,10 @@ void DBSQLite3::getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
 		std::cerr << "Warning: suboptimal access pattern for sqlite3 backend" << std::endl;
 #endif
 		loadBlockCache(z);
+		// the old iterator went away with the old cache
+		it = blockCache.find(x);
+		if (it == blockCache.end())
+			return;
 	}
 	// Swap lists to avoid copying contents
 	blocks.clear();
@@ -168,8 +261,53 @@ void DBSQLite3::getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
 }
 
 
+/* Like getBlocksOnXZ, but the blocks stay in the cache instead of being
+ * handed over, so nothing is copied and the column can be visited again.
+ */
+void DBSQLite3::visitBlocksOnXZ(int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb)
+{
+	if (z != blockCachedZ) {
+		loadBlockCache(z);
+		blockCachedZ = z;
+	}
+
+	auto it = blockCache.find(x);
+	if (it == blockCache.end())
+		return;
+	if (it->second.empty()) {
+		// handed over by getBlocksOnXZ
+		loadBlockCache(z);
+		it = blockCache.find(x);
+		if (it == blockCache.end())
+			return;
+	}
+
+	// the rows come sorted by position, so Y goes up
+	const BlockList &blocks = it->second;
+	for (auto block = blocks.rbegin(); block != blocks.rend(); ++block) {
+		if (block->first.y >= max_y)
+			continue;
+		if (block->first.y < min_y)
+			break;
+		if (!cb(block->first, block->second.data(), block->second.size()))
+			break;
+	}
+}
+
+
 void DBSQLite3::getBlocksByPos(BlockList &blocks,
 			const std::vector<BlockPos> &positions)
+{
+	visitBlocksByPos(positions, [&] (BlockPos pos, const u8 *data, size_t size) {
+		blocks.emplace_back(pos, ustring(data, size));
+		return true;
+	});
+}
+
+
+void DBSQLite3::visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb)
 {
 	int result;
 
@@ -177,20 +315,96 @@ void DBSQLite3::getBlocksByPos(BlockList &blocks,
 		int64_t dbPos = encodeBlockPos(pos);
 		SQLOK(bind_int64(stmt_get_block_exact, 1, dbPos));
 
+		StatementReset reset(stmt_get_block_exact);
 		while ((result = sqlite3_step(stmt_get_block_exact)) == SQLITE_BUSY) {
 			usleep(10000); // Wait some time and try again
 		}
+		bool more = true;
 		if (result == SQLITE_DONE) {
 			// no data
 		} else if (result != SQLITE_ROW) {
 			throw std::runtime_error(sqlite3_errmsg(db));
 		} else {
+			// the blob stays valid until the statement is reset
 			const unsigned char *data = reinterpret_cast<const unsigned char *>(
 					sqlite3_column_blob(stmt_get_block_exact, 0));
 			size_t size = sqlite3_column_bytes(stmt_get_block_exact, 0);
-			blocks.emplace_back(pos, ustring(data, size));
+			more = cb(pos, data, size);
+		}
+		if (!more)
+			break;
+	}
+}
+
+
+/* The engine writes blocks using REPLACE INTO, which deletes the old row and
+ * inserts a new one with rowid = max(rowid) + 1. So everything that changed
+ * after we took note of the highest rowid can be found above it.
+ * Since rowids are reused when the newest row itself is replaced, the token
+ * also contains its position to detect when this assumption is broken.
+ */
+std::string DBSQLite3::getChangeToken()
+{
+	int result;
+	int64_t rowid = 0, posHash = 0;
+
+	StatementReset reset(stmt_get_last_rowid);
+	while ((result = sqlite3_step(stmt_get_last_rowid)) == SQLITE_BUSY) {
+		usleep(10000); // Wait some time and try again
+	}
+	if (result == SQLITE_ROW) {
+		rowid = sqlite3_column_int64(stmt_get_last_rowid, 0);
+		posHash = sqlite3_column_int64(stmt_get_last_rowid, 1);
+	} else if (result != SQLITE_DONE) {
+		throw std::runtime_error(sqlite3_errmsg(db));
+	}
+
+	std::ostringstream oss;
+	oss << rowid << ":" << posHash;
+	return oss.str();
+}
+
+
+bool DBSQLite3::getChangedBlockPos(const std::string &token,
+		std::vector<BlockPos> &positions)
+{
+	int result;
+	int64_t rowid, posHash;
+
+	std::istringstream iss(token);
+	char c;
+	iss >> rowid >> c >> posHash;
+	if (iss.fail() || c != ':')
+		return false;
+
+	if (rowid > 0) {
+		// check that the newest row is still the one we remember
+		SQLOK(bind_int64(stmt_get_rowid_pos, 1, rowid))
+		StatementReset reset(stmt_get_rowid_pos);
+		while ((result = sqlite3_step(stmt_get_rowid_pos)) == SQLITE_BUSY) {
+			usleep(10000); // Wait some time and try again
+		}
+		bool same = false;
+		if (result == SQLITE_ROW)
+			same = sqlite3_column_int64(stmt_get_rowid_pos, 0) == posHash;
+		else if (result != SQLITE_DONE)
+			throw std::runtime_error(sqlite3_errmsg(db));
+		if (!same)
+			return false;
+	}
+
+	// the remembered row itself may have been replaced in-place, include it
+	SQLOK(bind_int64(stmt_get_changed_pos, 1, rowid))
+	StatementReset reset(stmt_get_changed_pos);
+	while ((result = sqlite3_step(stmt_get_changed_pos)) != SQLITE_DONE) {
+		if (result == SQLITE_BUSY) { // Wait some time and try again
+			usleep(10000);
+		} else if (result != SQLITE_ROW) {
+			throw std::runtime_error(sqlite3_errmsg(db));
 		}
 
-		SQLOK(reset(stmt_get_block_exact))
+		positions.emplace_back(decodeBlockPos(
+			sqlite3_column_int64(stmt_get_changed_pos, 0)));
 	}
+	return true;
 }
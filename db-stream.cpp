@@ -0,0 +1,250 @@
+#include <stdexcept>
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+#include "db-stream.h"
+#include "Trace.h"
+
+// larger than any block Luanti will write, anything beyond is misframed
+#define MAX_BLOCK_SIZE (64 * 1024 * 1024)
+
+static inline int seekTo(FILE *f, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(f, offset, SEEK_SET);
+#else
+	return fseeko(f, offset, SEEK_SET);
+#endif
+}
+
+static inline bool entryBefore(BlockPos a, BlockPos b)
+{
+	if (a.z != b.z)
+		return a.z < b.z;
+	if (a.x != b.x)
+		return a.x < b.x;
+	return a.y > b.y;
+}
+
+
+DBStream::DBStream(const std::string &path)
+{
+	if (path == "-") {
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		file = stdin;
+	} else {
+		file = fopen(path.c_str(), "rb");
+		if (!file)
+			throw std::runtime_error("Failed to open stream");
+	}
+}
+
+
+DBStream::~DBStream()
+{
+	if (file && file != stdin)
+		fclose(file);
+	if (spillFile)
+		fclose(spillFile);
+}
+
+
+bool DBStream::setOption(const std::string &name, const std::string &value)
+{
+	if (name == "memory_budget") {
+		int mb = atoi(value.c_str());
+		if (mb < 1)
+			throw std::runtime_error("memory_budget needs to be 1 or higher");
+		memoryBudget = static_cast<size_t>(mb) * 1024 * 1024;
+		return true;
+	}
+	return false;
+}
+
+
+void DBStream::readAll(BlockPos min, BlockPos max)
+{
+	Trace::Span span(m_trace, "read stream", "db");
+	read = true;
+
+	u8 header[10];
+	size_t n;
+	while ((n = fread(header, 1, sizeof(header), file)) == sizeof(header)) {
+		auto i16 = [&] (int i) {
+			return static_cast<int16_t>(header[i] | header[i+1] << 8);
+		};
+		BlockPos pos(i16(0), i16(2), i16(4));
+		uint32_t size = header[6] | header[7] << 8 | header[8] << 16 |
+			(uint32_t) header[9] << 24;
+		if (size > MAX_BLOCK_SIZE)
+			throw std::runtime_error("Invalid record in stream");
+
+		if (pos.x < min.x || pos.x >= max.x ||
+			pos.y < min.y || pos.y >= max.y ||
+			pos.z < min.z || pos.z >= max.z) {
+			u8 buf[4096];
+			while (size > 0) {
+				size_t chunk = std::min<size_t>(size, sizeof(buf));
+				if (fread(buf, 1, chunk, file) != chunk)
+					throw std::runtime_error("Unexpected end of stream");
+				size -= chunk;
+			}
+			continue;
+		}
+
+		if (!spillFile && data.size() + size <= memoryBudget) {
+			size_t offset = data.size();
+			data.resize(offset + size);
+			if (fread(data.data() + offset, 1, size, file) != size)
+				throw std::runtime_error("Unexpected end of stream");
+			index.push_back(Entry{pos, size, false, offset});
+			continue;
+		}
+
+		if (!spillFile && !(spillFile = tmpfile()))
+			throw std::runtime_error("Failed to create temporary file");
+		spillBuffer.resize(size);
+		if (fread(spillBuffer.data(), 1, size, file) != size)
+			throw std::runtime_error("Unexpected end of stream");
+		if (fwrite(spillBuffer.data(), 1, size, spillFile) != size)
+			throw std::runtime_error("Failed to write temporary file");
+		index.push_back(Entry{pos, size, true, spillSize});
+		spillSize += size;
+	}
+	if (ferror(file))
+		throw std::runtime_error("Failed to read stream");
+	if (n != 0)
+		throw std::runtime_error("Unexpected end of stream");
+
+	// the last record for a position wins
+	std::stable_sort(index.begin(), index.end(), [] (const Entry &a, const Entry &b) {
+		return entryBefore(a.pos, b.pos);
+	});
+	auto last = std::unique(index.rbegin(), index.rend(), [] (const Entry &a, const Entry &b) {
+		return a.pos.x == b.pos.x && a.pos.y == b.pos.y && a.pos.z == b.pos.z;
+	});
+	index.erase(index.begin(), last.base());
+	index.shrink_to_fit();
+	if (spillFile && fflush(spillFile) != 0)
+		throw std::runtime_error("Failed to write temporary file");
+#ifndef NDEBUG
+	std::cerr << "Read " << index.size() << " blocks from stream";
+	if (spillFile)
+		std::cerr << ", " << spillSize << " bytes of them went to a temporary file";
+	std::cerr << std::endl;
+#endif
+}
+
+
+// valid until the next call
+const u8 *DBStream::blockData(const Entry &e)
+{
+	if (!e.spilled)
+		return data.data() + e.offset;
+	spillBuffer.resize(e.size);
+	if (seekTo(spillFile, e.offset) != 0 ||
+			fread(spillBuffer.data(), 1, e.size, spillFile) != e.size)
+		throw std::runtime_error("Failed to read temporary file");
+	return spillBuffer.data();
+}
+
+
+std::pair<const DBStream::Entry*, const DBStream::Entry*> DBStream::column(
+		int16_t x, int16_t z)
+{
+	if (!read)
+		readAll(BlockPos(-2048), BlockPos(2048));
+	const Entry *begin = index.data(), *end = begin + index.size();
+	begin = std::lower_bound(begin, end, BlockPos(x, 2047, z),
+		[] (const Entry &e, BlockPos pos) {
+			return entryBefore(e.pos, pos);
+		});
+	end = std::upper_bound(begin, end, BlockPos(x, -2048, z),
+		[] (BlockPos pos, const Entry &e) {
+			return entryBefore(pos, e.pos);
+		});
+	return std::make_pair(begin, end);
+}
+
+
+std::vector<BlockPos> DBStream::getBlockPos(BlockPos min, BlockPos max)
+{
+	if (!read)
+		readAll(min, max);
+
+	std::vector<BlockPos> positions;
+	for (const auto &e : index) {
+		if (e.pos.x >= min.x && e.pos.x < max.x &&
+			e.pos.y >= min.y && e.pos.y < max.y &&
+			e.pos.z >= min.z && e.pos.z < max.z)
+			positions.emplace_back(e.pos);
+	}
+	return positions;
+}
+
+
+bool DBStream::getExtent(BlockPos min, BlockPos max,
+		BlockPos &emin, BlockPos &emax)
+{
+	if (!read)
+		readAll(min, max);
+	return DB::getExtent(min, max, emin, emax);
+}
+
+
+void DBStream::getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y)
+{
+	visitBlocksOnXZ(x, z, min_y, max_y, [&] (BlockPos pos, const u8 *data, size_t size) {
+		blocks.emplace_back(pos, ustring(data, size));
+		return true;
+	});
+}
+
+
+void DBStream::visitBlocksOnXZ(int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb)
+{
+	auto col = column(x, z);
+	for (const Entry *e = col.first; e != col.second; e++) {
+		if (e->pos.y >= max_y)
+			continue;
+		if (e->pos.y < min_y)
+			break;
+		if (!cb(e->pos, blockData(*e), e->size))
+			break;
+	}
+}
+
+
+void DBStream::getBlocksByPos(BlockList &blocks,
+			const std::vector<BlockPos> &positions)
+{
+	visitBlocksByPos(positions, [&] (BlockPos pos, const u8 *data, size_t size) {
+		blocks.emplace_back(pos, ustring(data, size));
+		return true;
+	});
+}
+
+
+void DBStream::visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb)
+{
+	for (auto pos : positions) {
+		auto col = column(pos.x, pos.z);
+		const Entry *e = std::lower_bound(col.first, col.second, pos.y,
+			[] (const Entry &e, int16_t y) {
+				return e.pos.y > y;
+			});
+		if (e == col.second || e->pos.y != pos.y)
+			continue;
+		if (!cb(pos, blockData(*e), e->size))
+			break;
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "BlockDecoder.h"
+#include "db.h"
+
+/* Keeps decoded blocks for renders that need them again, the least
+ * recently used ones are dropped once the memory budget is exceeded.
+ * Can be used by several threads at once.
+ */
+class BlockCache {
+public:
+	typedef std::shared_ptr<const DecodedBlock> Block;
+
+	struct Stats {
+		size_t hits, misses, evictions;
+		size_t blocks, memory; // currently held
+	};
+
+	BlockCache(size_t budget); // in bytes
+
+	// returns nullptr if the block isn't cached
+	Block get(BlockPos pos);
+	void put(BlockPos pos, const Block &block);
+	void erase(BlockPos pos);
+	void clear();
+	Stats getStats();
+
+private:
+	struct Entry {
+		uint64_t key;
+		Block block;
+		size_t size;
+	};
+
+	static inline uint64_t blockKey(BlockPos pos)
+	{
+		return (uint64_t) (uint16_t) pos.x << 32 |
+			(uint64_t) (uint16_t) pos.y << 16 | (uint16_t) pos.z;
+	}
+
+	std::mutex m_mutex;
+	size_t m_budget;
+	// most recently used first
+	std::list<Entry> m_lru;
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> m_blocks;
+	Stats m_stats;
+};
@@ -1,19 +1,44 @@
 #pragma once
 
 #include <cstdint>
+#include <string>
 #include <unordered_map>
+#include <vector>
 #include "types.h"
 #include <ZstdDecompressor.h>
 
+class Timings;
+class Trace;
+
+/* A block reduced to what the renderer needs, so that it can be kept
+ * around: the names of its nodes and an index into them for every node.
+ */
+struct DecodedBlock {
+	std::vector<std::string> palette; // "" for air, ignore and invalid nodes
+	std::vector<uint16_t> nodes; // none if the block is empty
+
+	bool isEmpty() const { return nodes.empty(); }
+	const std::string &getNode(u8 x, u8 y, u8 z) const
+	{
+		return palette[nodes[x + (y << 4) + (z << 8)]];
+	}
+	size_t memoryUsage() const;
+};
+
 class BlockDecoder {
 public:
 	BlockDecoder();
 
 	void reset();
-	void decode(const ustring &data);
+	void decode(const ustring &data) { decode(data.data(), data.size()); }
+	void decode(const u8 *data, size_t length);
 	bool isEmpty() const;
 	// returns "" for air, ignore and invalid nodes
 	const std::string &getNode(u8 x, u8 y, u8 z) const;
+	// resolves every node of the decoded block
+	void resolve(DecodedBlock &out) const;
+	void setTimings(Timings *timings) { m_timings = timings; }
+	void setTrace(Trace *trace) { m_trace = trace; }
 
 private:
 	typedef std::unordered_map<uint16_t, std::string> NameMap;
@@ -25,4 +50,6 @@ private:
 
 	// one instance for performance
 	ZstdDecompressor m_zstd_decompressor;
+	Timings *m_timings;
+	Trace *m_trace;
 };
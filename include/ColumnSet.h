@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+/* Set of block columns, kept as one sorted array of (z, x) pairs.
+ * This costs 4 bytes per column, while adding at most twice that since
+ * duplicates are removed whenever the array doubles.
+ */
+class ColumnSet {
+public:
+	void clear()
+	{
+		m_columns.clear();
+		m_sorted = true;
+		m_compactAt = COMPACT_MIN;
+	}
+
+	// Columns can be added in any order, but only show up after finalize()
+	inline void add(int16_t x, int16_t z)
+	{
+		const uint32_t v = pack(x, z);
+		if (!m_columns.empty()) {
+			if (m_columns.back() == v)
+				return; // cheap deduplication for blocks of the same column
+			if (m_columns.back() > v)
+				m_sorted = false;
+		}
+		m_columns.push_back(v);
+		// positions that aren't in column order repeat every column
+		if (!m_sorted && m_columns.size() >= m_compactAt) {
+			compact();
+			m_compactAt = m_columns.size() * 2;
+			if (m_compactAt < COMPACT_MIN)
+				m_compactAt = COMPACT_MIN;
+		}
+	}
+
+	void finalize()
+	{
+		compact();
+		m_columns.shrink_to_fit();
+	}
+
+	size_t size() const { return m_columns.size(); }
+	bool empty() const { return m_columns.empty(); }
+
+	/* Calls column(x, z) for all columns in the order they are rendered in,
+	 * which is by Z and then X descending. Calls rowDone(z) after each row.
+	 */
+	template<typename F, typename G>
+	void forEachReverse(F column, G rowDone) const
+	{
+		auto it = m_columns.rbegin();
+		while (it != m_columns.rend()) {
+			const int16_t z = unpackZ(*it);
+			do {
+				column(unpackX(*it), z);
+				++it;
+			} while (it != m_columns.rend() && unpackZ(*it) == z);
+			rowDone(z);
+		}
+	}
+
+	/* Same order as forEachReverse(), but calls row(z, xs) once per row
+	 * with the X coordinates of all its columns.
+	 */
+	template<typename F>
+	void forEachRowReverse(F row) const
+	{
+		std::vector<int16_t> xs;
+		auto it = m_columns.rbegin();
+		while (it != m_columns.rend()) {
+			const int16_t z = unpackZ(*it);
+			xs.clear();
+			do {
+				xs.push_back(unpackX(*it));
+				++it;
+			} while (it != m_columns.rend() && unpackZ(*it) == z);
+			row(z, xs);
+		}
+	}
+
+private:
+	static const size_t COMPACT_MIN = 1 << 16;
+
+	void compact()
+	{
+		if (m_sorted)
+			return;
+		std::sort(m_columns.begin(), m_columns.end());
+		m_columns.erase(std::unique(m_columns.begin(), m_columns.end()),
+			m_columns.end());
+		m_sorted = true;
+	}
+
+	static inline uint32_t pack(int16_t x, int16_t z)
+	{
+		return (uint32_t) (uint16_t) (z + 32768) << 16 | (uint16_t) (x + 32768);
+	}
+	static inline int16_t unpackX(uint32_t v) { return (int) (v & 0xffff) - 32768; }
+	static inline int16_t unpackZ(uint32_t v) { return (int) (v >> 16) - 32768; }
+
+	std::vector<uint32_t> m_columns;
+	bool m_sorted = true;
+	size_t m_compactAt = COMPACT_MIN;
+};
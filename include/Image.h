@@ -15,18 +15,27 @@ struct Color {
 class Image {
 public:
 	Image(int width, int height);
+	Image(const std::string &filename);
 	~Image();
 
 	Image(const Image&) = delete;
 	Image& operator=(const Image&) = delete;
 
+	int getWidth() const { return m_width; }
+	int getHeight() const { return m_height; }
+
 	void setPixel(int x, int y, const Color &c);
 	Color getPixel(int x, int y);
 	void drawLine(int x1, int y1, int x2, int y2, const Color &c);
 	void drawText(int x, int y, const std::string &s, const Color &c);
 	void drawFilledRect(int x, int y, int w, int h, const Color &c);
 	void drawCircle(int x, int y, int diameter, const Color &c);
+	void copyRect(const Image &src, int x, int y, int w, int h);
 	void save(const std::string &filename);
+	// returns the image as a PNG file
+	std::string encodePNG();
+	// 4 bytes per pixel, row by row from the top
+	void copyToRGBA(u8 *buffer);
 
 private:
 	int m_width, m_height;
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include "db.h"
+
+/* Compact index of block positions for backends that can't query by
+ * position themselves.
+ * Columns are kept sorted by (z, x), each pointing to a sorted run of Y
+ * coordinates. This costs 2 bytes per block plus 8 bytes per column
+ * (8 bytes per block temporarily while adding).
+ */
+class PositionIndex {
+public:
+	typedef std::pair<const int16_t*, const int16_t*> YRange;
+
+	void clear();
+	// Positions can be added at any time, but only show up after finalize()
+	void add(BlockPos pos);
+	void finalize();
+
+	size_t size() const { return m_ys.size(); }
+	bool empty() const { return m_ys.empty(); }
+
+	/* Return sorted Y coordinates of blocks in the column given by x and z */
+	YRange column(int16_t x, int16_t z) const;
+	/* Read all positions inside the range given by min and max,
+	 * so that min.x <= x < max.x, ... into list
+	 */
+	void query(BlockPos min, BlockPos max, std::vector<BlockPos> &positions) const;
+	/* Same as query() but only count them */
+	size_t count(BlockPos min, BlockPos max) const;
+	/* Same as query() but only find the bounding box (inclusive),
+	 * returns false if there are no positions
+	 */
+	bool extent(BlockPos min, BlockPos max, BlockPos &emin, BlockPos &emax) const;
+
+	/* Save to or load from a file, together with a tag that identifies the
+	 * state of the world. Loading fails if the tag doesn't match.
+	 */
+	void save(const std::string &path, const std::string &tag) const;
+	bool load(const std::string &path, const std::string &tag);
+
+private:
+	struct Column {
+		int16_t z, x;
+		uint32_t offset; // into m_ys
+	};
+
+	template<typename F>
+	void forEach(BlockPos min, BlockPos max, F cb) const;
+	// index of the first column not before (z, x)
+	size_t lowerBound(int16_t z, int16_t x) const;
+	bool valid() const;
+
+	std::vector<Column> m_columns; // with one sentinel at the end
+	std::vector<int16_t> m_ys;
+	std::vector<uint64_t> m_pending;
+};
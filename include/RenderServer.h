@@ -0,0 +1,34 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+
+/* Answers requests on a UNIX domain socket. Messages in both directions
+ * are framed as a little endian uint32 length followed by that many bytes.
+ * Every connection is served by its own thread and can send any number
+ * of requests, one after another. Only a limited number of connections
+ * is served at a time, further clients wait until one is closed.
+ */
+class RenderServer {
+public:
+	typedef std::function<std::string(const std::string &request)> Handler;
+
+	RenderServer(const std::string &path);
+	~RenderServer();
+
+	// returns after SIGINT or SIGTERM, once all connections are closed
+	void run(const Handler &handler);
+
+private:
+	void serveConnection(int fd, const Handler &handler);
+
+	std::string m_path;
+	int m_fd;
+	int m_wake[2]; // pipe to interrupt waiting for connections
+	std::mutex m_mutex;
+	std::condition_variable m_done;
+	std::set<int> m_connections;
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/* What a render found on the surface of the map for one pixel.
+ * Node IDs index the name table of the cache, 0 means none.
+ */
+struct SurfacePixel {
+	uint16_t node;        // node that made the pixel opaque
+	/* Translucent nodes above it (--drawalpha) as two runs of the same
+	 * node from the top down, further nodes are counted into the second.
+	 */
+	uint16_t alphaNode[2];
+	uint8_t alphaLayers[2];
+	int16_t height;       // PixelAttribute::height
+	int16_t alphaHeight;  // height of the first translucent node
+	uint8_t drawn;        // if anything was drawn at all
+	uint8_t reserved;
+
+	void reset()
+	{
+		node = alphaNode[0] = alphaNode[1] = 0;
+		alphaLayers[0] = alphaLayers[1] = 0;
+		height = alphaHeight = INT16_MIN;
+		drawn = reserved = 0;
+	}
+
+	void addAlpha(uint16_t id, int16_t y)
+	{
+		int run = 0;
+		if (!alphaNode[0]) {
+			alphaNode[0] = id;
+			alphaHeight = y;
+		} else if (alphaNode[1] || id != alphaNode[0]) {
+			run = 1;
+			if (!alphaNode[1])
+				alphaNode[1] = id;
+		}
+		if (alphaLayers[run] < 255)
+			alphaLayers[run]++;
+	}
+};
+
+enum {
+	SURFACE_ALPHA = (1 << 0), // written with --drawalpha
+};
+
+struct SurfaceCacheInfo {
+	int32_t xMin, xMax, zMin, zMax; // block units, as on the image
+	int32_t yMin, yMax; // node units
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+/* A surface cache holds the pixels of a rendered map before colors are
+ * applied, in rows of 16 pixels from the top of the image down.
+ * Rows that were not rendered are missing.
+ */
+class SurfaceCacheWriter {
+public:
+	SurfaceCacheWriter(const std::string &path, const SurfaceCacheInfo &info);
+	~SurfaceCacheWriter();
+
+	uint16_t intern(const std::string &name);
+	// pixels are 16 lines of the image width
+	void writeRow(int16_t z, const SurfacePixel *pixels);
+	void finish();
+
+private:
+	void write(const void *data, size_t size);
+
+	std::string m_path;
+	FILE *m_file;
+	SurfaceCacheInfo m_info;
+	size_t m_width;
+	uint64_t m_offset;
+	uint32_t m_rows;
+	std::unordered_map<std::string, uint16_t> m_ids;
+	std::vector<std::string> m_names;
+};
+
+class SurfaceCacheReader {
+public:
+	SurfaceCacheReader(const std::string &path);
+	~SurfaceCacheReader();
+
+	const SurfaceCacheInfo &info() const { return m_info; }
+	// indexed by node ID, the first entry is empty
+	const std::vector<std::string> &names() const { return m_names; }
+	size_t rowCount() const { return m_rows; }
+
+	// returns false after the last row
+	bool readRow(int16_t &z, std::vector<SurfacePixel> &pixels);
+
+private:
+	FILE *m_file;
+	SurfaceCacheInfo m_info;
+	size_t m_width;
+	uint32_t m_rows, m_rowsRead;
+	std::vector<std::string> m_names;
+};
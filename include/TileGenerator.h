@@ -1,19 +1,30 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <set>
 #include <unordered_map>
 #include <cstdint>
+#include <climits>
 #include <string>
+#include <vector>
 
 #include "PixelAttributes.h"
+#include "ColumnSet.h"
+#include "SurfaceCache.h"
 #include "Image.h"
+#include "Timings.h"
+#include "Trace.h"
 #include "db.h"
 #include "types.h"
 
-class BlockDecoder;
+class BlockCache;
+class DBShared;
 class Image;
+struct SharedWorld;
 
 enum {
 	SCALE_TOP = (1 << 0),
@@ -63,12 +74,34 @@ struct BitmapThing { // 16x16 bitmap
 };
 
 
+/* One image of a batch, anything not given is taken from the generator
+ */
+struct RenderJob {
+	RenderJob() : x(0), y(0), w(0), h(0), zoom(0),
+		minY(INT_MIN), maxY(INT_MIN), drawAlpha(false), drawScale(false),
+		drawOrigin(false), noShading(false) {}
+	/* Parses "<output> [options]", where the options are written like on
+	 * the command line. Returns false on errors.
+	 */
+	bool parse(const std::string &line);
+
+	std::string output;
+	int x, y, w, h; // geometry, none if w == 0
+	int zoom;       // none if 0
+	int minY, maxY; // none if INT_MIN
+	// these can only be turned on
+	bool drawAlpha, drawScale, drawOrigin, noShading;
+};
+
 class TileGenerator
 {
 private:
 	typedef std::unordered_map<std::string, ColorEntry> ColorMap;
 
 public:
+	// takes the finished image instead of it being saved to a file
+	typedef std::function<void(Image &)> ImageSink;
+
 	TileGenerator();
 	~TileGenerator();
 	void setBgColor(const std::string &bgColor);
@@ -86,32 +119,73 @@ public:
 	void setExhaustiveSearch(int mode);
 	void parseColorsFile(const std::string &fileName);
 	void setBackend(std::string backend);
+	void setBackendOption(const std::string &name, const std::string &value);
 	void setZoom(int zoom);
 	void setScales(uint flags);
 	void setDontWriteEmpty(bool f);
+	void setIncremental(bool f);
+	void setSurfaceCache(const std::string &path);
+	void setBlockCacheSize(int megabytes);
+	void setTimings(bool json);
+	void setTrace(const std::string &path);
+	/* Writing to a pipe whose reader went away raises SIGPIPE, which
+	 * programs using this should ignore. */
+	void setProgressFd(int fd, double interval);
 
 	void generate(const std::string &input, const std::string &output);
+	void generateFromCache(const std::string &cache, const std::string &input,
+		const std::string &output);
 	void printGeometry(const std::string &input);
 	void dumpBlock(const std::string &input, BlockPos pos);
+	void exportSnapshot(const std::string &input, const std::string &output);
+	void generateJobs(const std::string &input, const std::vector<RenderJob> &jobs,
+		unsigned int threads);
+	void serve(const std::string &input, const std::string &socketPath,
+		unsigned int threads);
+
+	/* For use as a library: opens the world once, afterwards the other
+	 * methods can be called from several threads at the same time.
+	 */
+	void openWorld(const std::string &input, unsigned int threads);
+	void renderJob(const RenderJob &job, const ImageSink &sink,
+		std::set<std::string> &unknownNodes) const;
+	// area of the map in nodes, false if there are no blocks in it
+	bool getExtent(const RenderJob &job, int &x, int &y, int &w, int &h) const;
+	void getImageSize(const RenderJob &job, int &width, int &height) const;
 
 	static std::set<std::string> getSupportedBackends();
 
 private:
 	void parseColorsStream(std::istream &in);
 	void openDb(const std::string &input);
+	void planTraversal();
+	void renderOutput(const std::string &input, const std::string &output);
+	DBShared *shareDb(bool caches);
+	void applyJob(const RenderJob &job);
 	void closeDatabase();
 	void loadBlocks();
+	void loadExtent();
+	bool renderIncremental(const std::string &output);
+	std::string getStateFingerprint() const;
+	void writeState(const std::string &output, const std::string &changeToken);
+	void setupImageArea(int &width, int &height);
 	void createImage();
 	void renderMap();
-	void renderMapBlock(const BlockDecoder &blk, const BlockPos &pos);
+	template<typename Block> // BlockDecoder or DecodedBlock
+	void renderMapBlock(const Block &blk, const BlockPos &pos);
 	void renderMapBlockBottom(const BlockPos &pos);
+	void renderSurfaceRow(int16_t zPos, const std::vector<SurfacePixel> &pixels,
+		const std::vector<const ColorEntry*> &colors);
 	void renderShading(int zPos);
 	void renderScale();
 	void renderOrigin();
 	void renderPlayers(const std::string &inputPath);
 	void writeImage(const std::string &output);
 	void printUnknown();
+	void printTimings();
+	void writeTrace();
 	void reportProgress(size_t count);
+	void writeProgressLine(size_t count);
 	int getImageX(int val, bool absolute=false) const;
 	int getImageY(int val, bool absolute=false) const;
 	void setZoomed(int x, int y, Color color);
@@ -127,11 +201,24 @@ private:
 	bool m_drawAlpha;
 	bool m_shading;
 	bool m_dontWriteEmpty;
+	bool m_incremental;
 	std::string m_backend;
+	std::map<std::string, std::string> m_backendOptions;
 	int m_xBorder, m_yBorder;
 
 	DB *m_db;
+	bool m_dbShared; // m_db belongs to someone else
 	Image *m_image;
+	std::string m_surfaceCachePath;
+	SurfaceCacheWriter *m_surfaceCache;
+	std::vector<SurfacePixel> m_surfaceRow; // 16 lines of the map
+	size_t m_blockCacheSize; // bytes
+	std::shared_ptr<BlockCache> m_blockCache; // shared between jobs
+	ImageSink m_imageSink;
+	std::shared_ptr<SharedWorld> m_world; // set by openWorld()
+	std::shared_ptr<Timings> m_timings; // none unless asked for
+	bool m_timingsJson;
+	std::shared_ptr<Trace> m_trace; // shared between threads
 	PixelAttributes m_blockPixelAttributes;
 	/* smallest/largest seen X or Z block coordinate */
 	int m_xMin;
@@ -152,7 +239,7 @@ private:
 	int m_exhaustiveSearch;
 	std::set<std::string> m_unknownNodes;
 	bool m_renderedAny;
-	std::map<int16_t, std::set<int16_t>> m_positions; /* indexed by Z, contains X coords */
+	ColumnSet m_positions;
 	ColorMap m_colorMap;
 	BitmapThing m_readPixels;
 	BitmapThing m_readInfo;
@@ -162,6 +249,15 @@ private:
 	int m_zoom;
 	uint m_scales;
 
+	bool m_showProgress;
 	size_t m_progressMax;
 	int m_progressLast; // percentage
+	/* JSON lines are written to this instead of the bar, -1 if not.
+	 * Their interval is in seconds. */
+	int m_progressFd;
+	double m_progressInterval;
+	std::string m_progressOutput;
+	std::chrono::steady_clock::time_point m_progressStart, m_progressNext;
+	size_t m_progressBlocks, m_progressBytes;
+	int16_t m_progressRow;
 }; // class TileGenerator
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+
+/* Where the time of a render goes. Time is counted for the innermost stage
+ * only, so that the stages add up to the whole render. One instance must
+ * only be used by one thread, the ones of parallel renders can be merged.
+ * After merging the stages hold the time all threads spent in them, which
+ * can exceed the wall time, so they are printed as thread time.
+ */
+class Timings {
+public:
+	enum Stage {
+		OTHER, // outside of any stage
+		OPEN,
+		PLAN,
+		LIST,
+		READ,
+		DECOMPRESS,
+		DECODE,
+		RENDER,
+		SHADING,
+		DRAW,
+		ENCODE,
+		STAGE_COUNT
+	};
+
+	enum Counter {
+		BLOCKS_READ,
+		BYTES_READ,
+		BLOCKS_DECODED,
+		BYTES_DECOMPRESSED,
+		BLOCKS_EMPTY,
+		COLUMNS,
+		COLUMNS_COVERED, // rendering stopped before the bottom
+		CACHE_HITS, // of the block cache shared by --jobs
+		CACHE_MISSES,
+		CACHE_EVICTIONS,
+		COUNTER_COUNT
+	};
+
+	/* Counts the time until it goes out of scope for the stage, does
+	 * nothing if timings is nullptr.
+	 */
+	class Scope {
+	public:
+		Scope(Timings *timings, Stage stage) : m_timings(timings)
+		{
+			if (m_timings)
+				m_previous = m_timings->enter(stage);
+		}
+		~Scope()
+		{
+			if (m_timings)
+				m_timings->enter(m_previous);
+		}
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		Timings *m_timings;
+		Stage m_previous;
+	};
+
+	Timings();
+
+	// returns the previous stage
+	Stage enter(Stage stage);
+	void count(Counter counter, size_t n = 1) { m_counters[counter] += n; }
+	void merge(const Timings &other);
+	// forgets the time since the stage last changed, it was counted elsewhere
+	void skip();
+	/* Records the traversal mode and how it was chosen: cost holds the
+	 * estimated seconds of never, y and full, or is nullptr if the planner
+	 * didn't sample (samples is the number of rows it did).
+	 */
+	void plan(const char *mode, const char *reason,
+		int samples = 0, int rows = 0, const double *cost = nullptr);
+
+	// the wall time is the time since construction
+	void print(std::ostream &os, bool json);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	Clock::time_point m_start, m_last;
+	double m_lastCpu;
+	Stage m_stage;
+	double m_wall[STAGE_COUNT], m_cpu[STAGE_COUNT]; // seconds
+	size_t m_counters[COUNTER_COUNT];
+	const char *m_planMode, *m_planReason;
+	int m_planSamples, m_planRows;
+	double m_planCost[3];
+	bool m_planEstimated;
+	bool m_merged;
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Records spans of time to be looked at in chrome://tracing or Perfetto,
+ * written as JSON in the Chrome trace event format. Every thread gets its
+ * own track. Events are written to the file as they pile up, write() adds
+ * the rest. Can be used by several threads at once.
+ */
+class Trace {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/* Records the time until it goes out of scope, does nothing if trace
+	 * is nullptr. Fine spans are for things that happen very often, they
+	 * are added up per thread (see fineTotals()) and only kept on their
+	 * own if they took long enough to be interesting.
+	 */
+	class Span {
+	public:
+		Span(Trace *trace, const char *name, const char *category,
+			bool fine = false) :
+			m_trace(trace), m_name(name), m_category(category), m_fine(fine)
+		{
+			if (m_trace)
+				m_start = Clock::now();
+		}
+		~Span()
+		{
+			if (m_trace)
+				m_trace->add(m_name, m_category, m_start, Clock::now(), m_args, m_fine);
+		}
+
+		Span(const Span&) = delete;
+		Span& operator=(const Span&) = delete;
+
+		bool active() const { return m_trace != nullptr; }
+		// the inside of a JSON object, e.g. "\"z\":5"
+		void setArgs(const std::string &args) { m_args = args; }
+
+	private:
+		Trace *m_trace;
+		const char *m_name, *m_category;
+		bool m_fine;
+		Clock::time_point m_start;
+		std::string m_args;
+	};
+
+	Trace(const std::string &path);
+
+	void add(const char *name, const char *category, Clock::time_point start,
+		Clock::time_point end, const std::string &args, bool fine);
+	void setThreadName(const std::string &name);
+	/* Returns how often and for how long each fine span happened on the
+	 * calling thread since the last call, as JSON object members to add to
+	 * the args of a span, e.g. ",\"column\":{\"count\":2,\"dur\":35.000}".
+	 */
+	std::string fineTotals();
+	void write();
+
+	static std::string quote(const std::string &s);
+
+private:
+	struct Event {
+		const char *name, *category;
+		double ts, dur; // microseconds
+		int tid;
+		std::string args;
+	};
+
+	struct FineTotal {
+		const char *name;
+		size_t count;
+		double dur; // microseconds
+	};
+
+	// these need m_mutex to be held
+	int threadId();
+	void flush();
+
+	std::ofstream m_file;
+	bool m_first; // nothing written after the header yet
+	Clock::time_point m_start;
+	std::mutex m_mutex;
+	std::vector<Event> m_events;
+	std::map<int, std::vector<FineTotal>> m_fineTotals; // by thread
+	std::map<std::thread::id, int> m_threadIds;
+	std::map<int, std::string> m_threadNames;
+};
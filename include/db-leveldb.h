@@ -1,28 +1,70 @@
 #pragma once
 
 #include "db.h"
+#include "PositionIndex.h"
 #include <unordered_map>
 #include <utility>
+#include <cstdio>
 #include <leveldb/db.h>
 
 class DBLevelDB : public DB {
 public:
 	DBLevelDB(const std::string &mapdir);
 	std::vector<BlockPos> getBlockPos(BlockPos min, BlockPos max) override;
+	bool getExtent(BlockPos min, BlockPos max,
+			BlockPos &emin, BlockPos &emax) override;
 	void getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
 			int16_t min_y, int16_t max_y) override;
+	void visitBlocksOnXZ(int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y, const BlockVisitor &cb) override;
 	void getBlocksByPos(BlockList &blocks,
 			const std::vector<BlockPos> &positions) override;
+	void visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb) override;
 	~DBLevelDB() override;
 
 	bool preferRangeQueries() const override { return false; }
+	bool streamsBlocks() const override { return sequential; }
+	bool listsBlocksOnce() const override { return true; }
 
-private:
-	using pos2d = std::pair<int16_t, int16_t>;
+	bool setOption(const std::string &name, const std::string &value) override;
 
+private:
+	void ensurePosCache();
 	void loadPosCache();
+	std::string getWorldTag() const;
+	void setScanArea(BlockPos min, BlockPos max);
+	const BlockList *getScannedColumn(int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y);
+	void sortBlockCache();
+	void planBands(const std::vector<size_t> &rowSizes);
+	void scanAll(bool buildIndex);
+	void spill(FILE *&f, BlockPos pos, const u8 *data, size_t size);
+	void loadSpilledBand(int band);
+	void readSpilled(FILE *f, const std::function<void(BlockPos, const ustring&)> &cb);
 
-	// indexed by Z, contains all (x,y) position pairs
-	std::unordered_map<int16_t, std::vector<pos2d>> posCache;
+	PositionIndex posCache;
+	bool posCacheLoaded = false;
+	std::string indexFile; // where posCache is saved to, if set
+	std::string dbdir;
 	leveldb::DB *db;
+	leveldb::ReadOptions readOptions;
+
+	/* Sequential mode: the whole database is read with one iterator and the
+	 * blocks are sorted into bands of Z rows that fit the memory budget.
+	 * All bands but the one currently rendered are spilled to temporary files.
+	 * The same pass builds posCache, unless it was loaded from indexFile.
+	 */
+	bool sequential = false;
+	size_t memoryBudget = 1024 * 1024 * 1024;
+	bool scanned = false;
+	/* area of the first position or extent query, which is what the scan
+	 * keeps; columns outside of it are read block by block */
+	bool scanAreaSet = false;
+	BlockPos scanMin = BlockPos(-2048), scanMax = BlockPos(2048);
+	std::vector<int> bandOf; // indexed by Z + 2048
+	std::vector<FILE*> spillFiles; // indexed by band
+	int currentBand = -1;
+	// indexed by Z and X
+	std::unordered_map<int16_t, std::unordered_map<int16_t, BlockList>> blockCache;
 };
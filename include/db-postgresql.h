@@ -1,19 +1,38 @@
 #pragma once
 
 #include "db.h"
+#include <unordered_map>
 #include <libpq-fe.h>
 
 class DBPostgreSQL : public DB {
 public:
 	DBPostgreSQL(const std::string &mapdir);
 	std::vector<BlockPos> getBlockPos(BlockPos min, BlockPos max) override;
+	void visitBlockPos(BlockPos min, BlockPos max,
+			const std::function<void(BlockPos)> &cb) override;
+	bool getExtent(BlockPos min, BlockPos max,
+			BlockPos &emin, BlockPos &emax) override;
 	void getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
 		int16_t min_y, int16_t max_y) override;
+	void visitBlocksOnXZ(int16_t xPos, int16_t zPos,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb) override;
 	void getBlocksByPos(BlockList &blocks,
 			const std::vector<BlockPos> &positions) override;
+	void visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb) override;
+	void prefetchRow(int16_t z, const std::vector<int16_t> &xs,
+			int16_t min_y, int16_t max_y) override;
 	~DBPostgreSQL() override;
 
 	bool preferRangeQueries() const override { return true; }
+	bool streamsBlocks() const override { return cursorBatch > 0; }
+
+	bool setOption(const std::string &name, const std::string &value) override;
+
+	std::string getChangeToken() override;
+	std::string getChangeHint() override;
+	bool getChangedBlockPos(const std::string &token,
+			std::vector<BlockPos> &positions) override;
 
 protected:
 	PGresult *checkResults(PGresult *res, bool clear = true);
@@ -28,5 +47,48 @@ protected:
 	BlockPos pg_to_blockpos(PGresult *res, int row, int col);
 
 private:
+	void setRange(BlockPos min, BlockPos max);
+	void getRowRange(int16_t xPos, int16_t zPos, int16_t &min_x, int16_t &max_x);
+	PGresult *queryBlocksRange(int16_t zPos, int16_t min_x, int16_t max_x,
+		int16_t min_y, int16_t max_y, bool async = false);
+	bool fetchPipelined(int16_t xPos, int16_t zPos, int16_t min_y, int16_t max_y);
+	void drainPipeline();
+	void loadBlockCache(int16_t zPos, int16_t min_x, int16_t max_x,
+		int16_t min_y, int16_t max_y, PGresult *results = nullptr);
+	BlockList *getCachedColumn(int16_t xPos, int16_t zPos,
+		int16_t min_y, int16_t max_y);
+	bool fetchFromCursor(int16_t xPos, int16_t zPos,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb);
+	bool fetchCursorBatch();
+	void closeCursor();
+
 	PGconn *db;
+
+	/* Rows expected to be requested next (in order), so that the queries
+	 * for them can be sent ahead of time using libpq's pipeline mode */
+	std::vector<int16_t> rowQueue;
+	size_t rowQueueNext = 0, rowQueueSent = 0;
+	int pipelineDepth = 1;
+	bool pipelineActive = false;
+	int16_t pipelineMinY, pipelineMaxY;
+
+	/* Alternatively all blocks are streamed in the order they are needed
+	 * from a cursor, reading this many rows at once (0 = disabled).
+	 * Positions are then read from a cursor the same way. */
+	int cursorBatch = 0;
+	bool cursorOpen = false, cursorDone;
+	PGresult *cursorResult = nullptr;
+	int cursorRow;
+	int16_t cursorMinX, cursorMaxX, cursorMinZ, cursorMaxZ;
+	int16_t cursorMinY, cursorMaxY, cursorLastX, cursorLastZ;
+
+	// range of the last position query, used to limit the block cache
+	int16_t cacheMinX = -2048, cacheMaxX = 2048;
+	int16_t cacheMinZ = -2048, cacheMaxZ = 2048;
+	// columns of the row announced by prefetchRow()
+	int16_t rowHintZ = -10000, rowHintMinX, rowHintMaxX;
+	// the row in blockCache and which part of it was read
+	int16_t blockCachedZ = -10000, blockCachedMinX, blockCachedMaxX;
+	int16_t blockCachedMinY, blockCachedMaxY;
+	std::unordered_map<int16_t, BlockList> blockCache; // indexed by X
 };
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "db.h"
+#include "PositionIndex.h"
 #include <unordered_map>
 #include <utility>
 #include <functional>
@@ -10,25 +11,45 @@ class DBRedis : public DB {
 public:
 	DBRedis(const std::string &mapdir);
 	std::vector<BlockPos> getBlockPos(BlockPos min, BlockPos max) override;
+	bool getExtent(BlockPos min, BlockPos max,
+			BlockPos &emin, BlockPos &emax) override;
 	void getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
 		int16_t min_y, int16_t max_y) override;
+	void visitBlocksOnXZ(int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb) override;
 	void getBlocksByPos(BlockList &blocks,
 			const std::vector<BlockPos> &positions) override;
+	void visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb) override;
 	~DBRedis() override;
 
 	bool preferRangeQueries() const override { return false; }
+	bool listsBlocksOnce() const override { return true; }
+
+	bool setOption(const std::string &name, const std::string &value) override;
 
 private:
-	using pos2d = std::pair<int16_t, int16_t>;
 	static const char *replyTypeStr(int type);
 
-	void loadPosCache();
+	void ensurePosCache(BlockPos min, BlockPos max);
+	void loadPosCache(BlockPos min, BlockPos max);
+	void getColumnPos(int16_t x, int16_t z, int16_t min_y, int16_t max_y,
+			std::vector<BlockPos> &positions);
+	void scanKeys(const std::function<void(const redisReply*)> &cb);
 	void HMGET(const std::vector<BlockPos> &positions,
-			std::function<void(std::size_t, ustring)> result);
+			const std::function<bool(std::size_t, const u8 *, size_t)> &result);
 
-	// indexed by Z, contains all (x,y) position pairs
-	std::unordered_map<int16_t, std::vector<pos2d>> posCache;
+	PositionIndex posCache;
+	// area covered by posCache
+	bool posCacheLoaded = false;
+	BlockPos posCacheMin, posCacheMax;
+	std::string indexFile; // where posCache is saved to, if set
 
 	redisContext *ctx;
 	std::string hash;
+
+	int pipelineDepth = 8;
+	int scanCount = 1000; // 0 = use HKEYS
+	size_t batchSize; // adapted to reply size
+
 };
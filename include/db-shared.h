@@ -0,0 +1,82 @@
+#pragma once
+
+#include "db.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Wraps another backend so that several renders can use it at the same
+ * time. Access to the backend is serialized and the columns read from it
+ * are kept around for renders of overlapping areas, up to a memory limit.
+ */
+class DBShared : public DB {
+public:
+	DBShared(DB *db, size_t cacheSize); // takes ownership
+	std::vector<BlockPos> getBlockPos(BlockPos min, BlockPos max) override;
+	void visitBlockPos(BlockPos min, BlockPos max,
+			const std::function<void(BlockPos)> &cb) override;
+	bool getExtent(BlockPos min, BlockPos max,
+			BlockPos &emin, BlockPos &emax) override;
+	void getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y) override;
+	void visitBlocksOnXZ(int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y, const BlockVisitor &cb) override;
+	void getBlocksByPos(BlockList &blocks,
+			const std::vector<BlockPos> &positions) override;
+	void prefetchRow(int16_t z, const std::vector<int16_t> &xs,
+			int16_t min_y, int16_t max_y) override;
+	~DBShared() override;
+
+	bool preferRangeQueries() const override { return m_db->preferRangeQueries(); }
+	bool streamsBlocks() const override { return m_db->streamsBlocks(); }
+	bool listsBlocksOnce() const override { return m_db->listsBlocksOnce(); }
+	bool setOption(const std::string &name, const std::string &value) override;
+	void setTrace(Trace *trace) override
+	{
+		DB::setTrace(trace);
+		m_db->setTrace(trace);
+	}
+
+	std::string getChangeToken() override;
+	std::string getChangeHint() override;
+	bool getChangedBlockPos(const std::string &token,
+			std::vector<BlockPos> &positions) override;
+
+	// forget cached columns that contain any of the positions
+	void dropColumns(const std::vector<BlockPos> &positions);
+	void dropAll();
+
+private:
+	typedef std::shared_ptr<const BlockList> Column;
+	struct CacheEntry {
+		uint64_t key;
+		Column blocks;
+		size_t size;
+	};
+
+	static inline uint64_t columnKey(int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y)
+	{
+		return (uint64_t) (uint16_t) x << 48 | (uint64_t) (uint16_t) z << 32 |
+			(uint32_t) (uint16_t) min_y << 16 | (uint16_t) max_y;
+	}
+
+	std::unique_lock<std::mutex> lock();
+	// these need m_mutex to be held
+	Column findColumn(uint64_t key);
+	Column fetchColumn(uint64_t key, int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y);
+
+	DB *m_db;
+	std::mutex m_mutex;
+	// most recently used first
+	std::list<CacheEntry> m_lru;
+	std::unordered_map<uint64_t, std::list<CacheEntry>::iterator> m_columns;
+	size_t m_cacheSize, m_cacheLimit;
+#ifndef NDEBUG
+	size_t m_hits = 0, m_misses = 0;
+#endif
+};
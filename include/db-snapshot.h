@@ -0,0 +1,90 @@
+#pragma once
+
+#include "db.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/* A snapshot is a copy of the blocks of a world in a file that can be
+ * mapped into memory. Layout (native byte order, 8-byte aligned):
+ *   SnapshotHeader
+ *   block data, one column after another
+ *   SnapshotBlock[] sorted by column, then Y descending
+ *   SnapshotColumn[] sorted by (z, x)
+ */
+struct SnapshotHeader {
+	char magic[8];
+	uint32_t bom;
+	uint32_t reserved;
+	uint64_t numBlocks, blocksOffset;
+	uint64_t numColumns, columnsOffset;
+};
+
+struct SnapshotBlock {
+	int16_t y;
+	uint16_t reserved;
+	uint32_t size;
+	uint64_t offset; // from the start of the file
+};
+
+struct SnapshotColumn {
+	int16_t z, x;
+	uint32_t first, count; // into the blocks
+};
+
+class DBSnapshot : public DB {
+public:
+	DBSnapshot(const std::string &path);
+	std::vector<BlockPos> getBlockPos(BlockPos min, BlockPos max) override;
+	bool getExtent(BlockPos min, BlockPos max,
+			BlockPos &emin, BlockPos &emax) override;
+	void getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y) override;
+	void visitBlocksOnXZ(int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y, const BlockVisitor &cb) override;
+	void getBlocksByPos(BlockList &blocks,
+			const std::vector<BlockPos> &positions) override;
+	void visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb) override;
+	~DBSnapshot() override;
+
+	bool preferRangeQueries() const override { return true; }
+
+private:
+	template<typename F>
+	void forEachColumn(BlockPos min, BlockPos max, F cb) const;
+	const SnapshotColumn *findColumn(int16_t x, int16_t z) const;
+	void unmap();
+
+	const u8 *m_data;
+	size_t m_size;
+	std::vector<u8> m_buffer; // if the file couldn't be mapped
+	const SnapshotBlock *m_blocks;
+	const SnapshotColumn *m_columns;
+	size_t m_numColumns;
+};
+
+/* Writes a snapshot, columns need to be added in one go each
+ * with their blocks from the top down.
+ */
+class SnapshotWriter {
+public:
+	SnapshotWriter(const std::string &path);
+	~SnapshotWriter();
+
+	void addColumn(int16_t x, int16_t z);
+	void addBlock(int16_t y, const u8 *data, size_t size);
+	void finish();
+
+	size_t blockCount() const { return m_blocks.size(); }
+
+private:
+	void write(const void *data, size_t size);
+	void align();
+
+	std::string m_path;
+	FILE *m_file;
+	uint64_t m_offset;
+	std::vector<SnapshotBlock> m_blocks;
+	std::vector<SnapshotColumn> m_columns;
+};
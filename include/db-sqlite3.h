@@ -8,14 +8,24 @@ class DBSQLite3 : public DB {
 public:
 	DBSQLite3(const std::string &mapdir);
 	std::vector<BlockPos> getBlockPos(BlockPos min, BlockPos max) override;
+	bool getExtent(BlockPos min, BlockPos max,
+			BlockPos &emin, BlockPos &emax) override;
 	void getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
 			int16_t min_y, int16_t max_y) override;
+	void visitBlocksOnXZ(int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y, const BlockVisitor &cb) override;
 	void getBlocksByPos(BlockList &blocks,
 			const std::vector<BlockPos> &positions) override;
+	void visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb) override;
 	~DBSQLite3() override;
 
 	bool preferRangeQueries() const override { return false; }
 
+	std::string getChangeToken() override;
+	bool getChangedBlockPos(const std::string &token,
+			std::vector<BlockPos> &positions) override;
+
 private:
 	inline void getPosRange(int64_t &min, int64_t &max, int16_t zPos,
 			int16_t zPos2) const;
@@ -25,8 +35,12 @@ private:
 
 	sqlite3_stmt *stmt_get_block_pos;
 	sqlite3_stmt *stmt_get_block_pos_z;
+	sqlite3_stmt *stmt_get_extent;
 	sqlite3_stmt *stmt_get_blocks_z;
 	sqlite3_stmt *stmt_get_block_exact;
+	sqlite3_stmt *stmt_get_last_rowid;
+	sqlite3_stmt *stmt_get_rowid_pos;
+	sqlite3_stmt *stmt_get_changed_pos;
 
 	int16_t blockCachedZ = -10000;
 	std::unordered_map<int16_t, BlockList> blockCache; // indexed by X
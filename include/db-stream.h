@@ -0,0 +1,60 @@
+#pragma once
+
+#include "db.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/* Reads blocks from a stream of records, each consisting of
+ *   int16 x, y, z; uint32 length; u8 data[length]
+ * in little endian. If a position comes up more than once the last
+ * record wins.
+ */
+class DBStream : public DB {
+public:
+	DBStream(const std::string &path);
+	std::vector<BlockPos> getBlockPos(BlockPos min, BlockPos max) override;
+	bool getExtent(BlockPos min, BlockPos max,
+			BlockPos &emin, BlockPos &emax) override;
+	void getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y) override;
+	void visitBlocksOnXZ(int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y, const BlockVisitor &cb) override;
+	void getBlocksByPos(BlockList &blocks,
+			const std::vector<BlockPos> &positions) override;
+	void visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb) override;
+	~DBStream() override;
+
+	bool preferRangeQueries() const override { return true; }
+	bool streamsBlocks() const override { return true; }
+
+	bool setOption(const std::string &name, const std::string &value) override;
+
+private:
+	struct Entry {
+		BlockPos pos;
+		uint32_t size;
+		bool spilled;
+		size_t offset; // into data or spillFile
+	};
+
+	void readAll(BlockPos min, BlockPos max);
+	std::pair<const Entry*, const Entry*> column(int16_t x, int16_t z);
+	const u8 *blockData(const Entry &e);
+
+	FILE *file;
+	/* The stream can only be read once, so everything outside of the area
+	 * of the first query is thrown away.
+	 */
+	bool read = false;
+	std::vector<u8> data;
+	std::vector<Entry> index; // sorted by Z, X and then Y descending
+
+	/* Block data beyond the budget goes to a temporary file and is read
+	 * back one block at a time, only the index stays in memory. */
+	size_t memoryBudget = 1024 * 1024 * 1024;
+	FILE *spillFile = nullptr;
+	size_t spillSize = 0;
+	std::vector<u8> spillBuffer;
+};
@@ -1,11 +1,16 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <functional>
 #include <list>
+#include <string>
 #include <vector>
 #include <utility>
 #include "types.h"
 
+class Trace;
+
 
 struct BlockPos {
 	int16_t x;
@@ -39,6 +44,11 @@ struct BlockPos {
 typedef std::pair<BlockPos, ustring> Block;
 typedef std::list<Block> BlockList;
 
+/* Receives the data of a block, which is only valid during the call.
+ * Returning false stops the visit.
+ */
+typedef std::function<bool(BlockPos pos, const u8 *data, size_t size)> BlockVisitor;
+
 
 class DB {
 protected:
@@ -46,30 +56,145 @@ protected:
 	inline int64_t  encodeBlockPos(const BlockPos pos) const;
 	inline BlockPos decodeBlockPos(int64_t hash) const;
 
+	Trace *m_trace = nullptr; // see setTrace()
+
 public:
 	/* Return all block positions inside the range given by min and max,
 	 * so that min.x <= x < max.x, ...
 	 */
 	virtual std::vector<BlockPos> getBlockPos(BlockPos min, BlockPos max) = 0;
+	/* Visit the same positions as getBlockPos, backends that can should
+	 * do so without holding all of them in memory at once.
+	 */
+	virtual void visitBlockPos(BlockPos min, BlockPos max,
+			const std::function<void(BlockPos)> &cb);
 	/* Read all blocks in column given by x and z
 	 * and inside the given Y range (min_y <= y < max_y) into list
 	 */
 	virtual void getBlocksOnXZ(BlockList &blocks, int16_t x, int16_t z,
 			int16_t min_y, int16_t max_y) = 0;
+	/* Visit blocks in column given by x and z and inside the given Y range
+	 * from the top down. Backends that can should fetch only as much as
+	 * the visitor needs.
+	 */
+	virtual void visitBlocksOnXZ(int16_t x, int16_t z,
+			int16_t min_y, int16_t max_y, const BlockVisitor &cb);
+	/* Find the smallest box that contains all blocks inside the range given
+	 * by min and max (like getBlockPos), so that emin.x <= x <= emax.x, ...
+	 * Returns false if there are no blocks.
+	 */
+	virtual bool getExtent(BlockPos min, BlockPos max,
+			BlockPos &emin, BlockPos &emax);
 	/* Read blocks at given positions into list
 	 */
 	virtual void getBlocksByPos(BlockList &blocks,
 			const std::vector<BlockPos> &positions) = 0;
+	/* Visit blocks at given positions, in the same order
+	 */
+	virtual void visitBlocksByPos(const std::vector<BlockPos> &positions,
+			const BlockVisitor &cb);
+	/* Hint that the columns given by xs (in this order) and z will be
+	 * visited next, inside the given Y range. Backends can use this to fetch
+	 * them in one go.
+	 */
+	virtual void prefetchRow(int16_t z, const std::vector<int16_t> &xs,
+			int16_t min_y, int16_t max_y) {}
 	/* Can this database efficiently do range queries?
 	 * (for large data sets, more efficient that brute force)
 	 */
 	virtual bool preferRangeQueries() const = 0;
+	/* Is the backend set up to stream all blocks in the order the renderer
+	 * asks for them? Then only range queries make sense.
+	 */
+	virtual bool streamsBlocks() const { return false; }
+	/* Are the positions of blocks listed only once, so that blocks added
+	 * to the map later are never seen?
+	 */
+	virtual bool listsBlocksOnce() const { return false; }
+
+	/* Set a backend-specific option, this happens before any queries.
+	 * Returns false if the option is unknown to the backend.
+	 */
+	virtual bool setOption(const std::string &name, const std::string &value) { return false; }
+
+	/* Record what takes long (like loading a row of blocks) into trace,
+	 * which can be used by several threads. nullptr turns it off.
+	 */
+	virtual void setTrace(Trace *trace) { m_trace = trace; }
+
+	/* Return an opaque token that describes the current state of the
+	 * database for incremental rendering, empty if not supported.
+	 */
+	virtual std::string getChangeToken() { return ""; }
+	/* Return a token that is cheaper to get than getChangeToken() and
+	 * changes when the blocks change, though possibly with some delay.
+	 * Empty if not supported, then only getChangeToken() tells.
+	 */
+	virtual std::string getChangeHint() { return ""; }
+	/* Read positions of all blocks that were modified after the token was
+	 * taken into list. Returns false if the token can't be used anymore.
+	 * Deleted blocks are not included.
+	 */
+	virtual bool getChangedBlockPos(const std::string &token,
+			std::vector<BlockPos> &positions) { return false; }
 
 
 	virtual ~DB() {}
 };
 
 
+inline bool DB::getExtent(BlockPos min, BlockPos max,
+		BlockPos &emin, BlockPos &emax)
+{
+	std::vector<BlockPos> positions = getBlockPos(min, max);
+	if (positions.empty())
+		return false;
+	emin = emax = positions.front();
+	for (auto pos : positions) {
+		emin.x = std::min(emin.x, pos.x);
+		emin.y = std::min(emin.y, pos.y);
+		emin.z = std::min(emin.z, pos.z);
+		emax.x = std::max(emax.x, pos.x);
+		emax.y = std::max(emax.y, pos.y);
+		emax.z = std::max(emax.z, pos.z);
+	}
+	return true;
+}
+
+
+inline void DB::visitBlockPos(BlockPos min, BlockPos max,
+		const std::function<void(BlockPos)> &cb)
+{
+	for (auto pos : getBlockPos(min, max))
+		cb(pos);
+}
+
+
+inline void DB::visitBlocksOnXZ(int16_t x, int16_t z,
+		int16_t min_y, int16_t max_y, const BlockVisitor &cb)
+{
+	BlockList blocks;
+	getBlocksOnXZ(blocks, x, z, min_y, max_y);
+	blocks.sort();
+	for (const auto &it : blocks) {
+		if (!cb(it.first, it.second.data(), it.second.size()))
+			break;
+	}
+}
+
+
+inline void DB::visitBlocksByPos(const std::vector<BlockPos> &positions,
+		const BlockVisitor &cb)
+{
+	BlockList blocks;
+	getBlocksByPos(blocks, positions);
+	for (const auto &it : blocks) {
+		if (!cb(it.first, it.second.data(), it.second.size()))
+			break;
+	}
+}
+
+
 
 /****************
  * Black magic! *
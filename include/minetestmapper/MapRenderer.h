@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+
+/* What to render, like the options of the same name on the command line.
+ */
+struct MapRenderOptions {
+	MapRenderOptions() : x(0), z(0), w(0), h(0), minY(-32768), maxY(32767),
+		zoom(1), drawAlpha(false), drawScale(false), drawOrigin(false),
+		shading(true) {}
+
+	int x, z, w, h; // area in nodes, the whole map if w == 0
+	int minY, maxY;
+	int zoom;
+	bool drawAlpha, drawScale, drawOrigin, shading;
+};
+
+/* Renders a world into memory, for programs that link to libminetestmapper.
+ * The world is opened once and can then be rendered from several threads
+ * at the same time. Errors are thrown as std::runtime_error.
+ */
+class MapRenderer {
+public:
+	// the backend is read from world.mt if not given
+	MapRenderer(const std::string &worldPath, const std::string &colorsPath,
+		const std::string &backend = "");
+	~MapRenderer();
+
+	MapRenderer(const MapRenderer&) = delete;
+	MapRenderer& operator=(const MapRenderer&) = delete;
+
+	// area of the map in nodes within the options' area, false if empty
+	bool getExtent(const MapRenderOptions &options, int &x, int &z, int &w, int &h);
+	void getImageSize(const MapRenderOptions &options, int &width, int &height);
+
+	/* Renders into width * height pixels of RGBA, 4 bytes each and row by
+	 * row from the top. The size has to be the one of getImageSize().
+	 */
+	void renderRGBA(const MapRenderOptions &options, uint8_t *buffer,
+		int width, int height);
+	// returns a PNG file
+	std::string renderPNG(const MapRenderOptions &options);
+
+	// nodes without a color that came up so far
+	std::set<std::string> getUnknownNodes();
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> m_impl;
+};
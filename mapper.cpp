@@ -1,3 +1,4 @@
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -8,6 +9,8 @@
 #include <string>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 #include "config.h"
 #include "TileGenerator.h"
 
@@ -29,6 +32,7 @@ static void usage()
 		{"--min-y", "<y>"},
 		{"--max-y", "<y>"},
 		{"--backend", "<backend>"},
+		{"--backend-option", "<name>=<value>"},
 		{"--geometry", "x:y+w+h"},
 		{"--extent", ""},
 		{"--zoom", "<zoomlevel>"},
@@ -36,6 +40,18 @@ static void usage()
 		{"--scales", "[t][b][l][r]"},
 		{"--exhaustive", "never|y|full|auto"},
 		{"--dumpblock", "x,y,z"},
+		{"--export-snapshot", "<file>"},
+		{"--incremental", ""},
+		{"--save-cache", "<file>"},
+		{"--from-cache", "<file>"},
+		{"--jobs", "<file>"},
+		{"--threads", "<count>"},
+		{"--block-cache", "<megabytes>"},
+		{"--serve", "<socket>"},
+		{"--timings", "text|json"},
+		{"--trace", "<file>"},
+		{"--progress-fd", "<fd>"},
+		{"--progress-interval", "<seconds>"},
 	};
 	const char *top_text =
 		"minetestmapper -i <world_path> -o <output_image.png> [options]\n"
@@ -71,6 +87,47 @@ static inline int stoi(const char *s)
 	return ret;
 }
 
+static inline double stod(const char *s)
+{
+	std::istringstream iss(s);
+	double ret = -1;
+	iss >> ret;
+	return ret;
+}
+
+static bool parse_geometry(const char *s, int &x, int &y, int &w, int &h)
+{
+	std::istringstream geometry(s);
+	char c;
+	geometry >> x >> c >> y >> w >> h;
+	return !geometry.fail() && c == ':' && w >= 1 && h >= 1;
+}
+
+/* Each line of a job file is an output path followed by options,
+ * # starts a comment.
+ */
+static std::vector<RenderJob> read_jobs(const std::string &path)
+{
+	std::ifstream ifs(path);
+	if (!ifs.good())
+		throw std::runtime_error("Failed to open job file");
+
+	std::vector<RenderJob> jobs;
+	std::string line;
+	for (int lineno = 1; std::getline(ifs, line); lineno++) {
+		size_t comment = line.find('#');
+		if (comment != std::string::npos)
+			line.erase(comment);
+		if (line.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+		RenderJob job;
+		if (!job.parse(line))
+			throw std::runtime_error("Invalid job in line " + std::to_string(lineno));
+		jobs.push_back(job);
+	}
+	return jobs;
+}
+
 static std::string search_colors(const std::string &worldpath)
 {
 	if (file_exists(worldpath + "/colors.txt"))
@@ -110,6 +167,7 @@ int main(int argc, char *argv[])
 		{"drawalpha", no_argument, 0, 'e'},
 		{"noshading", no_argument, 0, 'H'},
 		{"backend", required_argument, 0, 'd'},
+		{"backend-option", required_argument, 0, 'O'},
 		{"geometry", required_argument, 0, 'g'},
 		{"extent", no_argument, 0, 'E'},
 		{"min-y", required_argument, 0, 'a'},
@@ -120,6 +178,18 @@ int main(int argc, char *argv[])
 		{"noemptyimage", no_argument, 0, 'n'},
 		{"exhaustive", required_argument, 0, 'j'},
 		{"dumpblock", required_argument, 0, 'k'},
+		{"export-snapshot", required_argument, 0, 'x'},
+		{"incremental", no_argument, 0, 'I'},
+		{"save-cache", required_argument, 0, 'W'},
+		{"from-cache", required_argument, 0, 'F'},
+		{"jobs", required_argument, 0, 'J'},
+		{"threads", required_argument, 0, 'T'},
+		{"block-cache", required_argument, 0, 'B'},
+		{"serve", required_argument, 0, 'V'},
+		{"timings", required_argument, 0, 'M'},
+		{"trace", required_argument, 0, 'A'},
+		{"progress-fd", required_argument, 0, 'G'},
+		{"progress-interval", required_argument, 0, 'N'},
 		{0, 0, 0, 0}
 	};
 
@@ -128,6 +198,15 @@ int main(int argc, char *argv[])
 	std::string colors;
 	bool onlyPrintExtent = false;
 	BlockPos dumpblock(INT16_MIN);
+	std::string snapshot;
+	std::string fromCache;
+	std::string jobsFile;
+	std::string socketPath;
+	unsigned int threads = std::thread::hardware_concurrency();
+	bool timings = false;
+	bool trace = false;
+	int progressFd = -1;
+	double progressInterval = 1;
 
 	TileGenerator generator;
 	while (1) {
@@ -179,6 +258,15 @@ int main(int argc, char *argv[])
 			case 'd':
 				generator.setBackend(optarg);
 				break;
+			case 'O': {
+					const char *eq = strchr(optarg, '=');
+					if (!eq || eq == optarg) {
+						usage();
+						exit(1);
+					}
+					generator.setBackendOption(std::string(optarg, eq - optarg), eq + 1);
+				}
+				break;
 			case 'a':
 				generator.setMinY(stoi(optarg));
 				break;
@@ -186,11 +274,8 @@ int main(int argc, char *argv[])
 				generator.setMaxY(stoi(optarg));
 				break;
 			case 'g': {
-					std::istringstream geometry(optarg);
 					int x, y, w, h;
-					char c;
-					geometry >> x >> c >> y >> w >> h;
-					if (geometry.fail() || c != ':' || w < 1 || h < 1) {
+					if (!parse_geometry(optarg, x, y, w, h)) {
 						usage();
 						exit(1);
 					}
@@ -230,6 +315,65 @@ int main(int argc, char *argv[])
 					generator.setExhaustiveSearch(mode);
 				}
 				break;
+			case 'I':
+				generator.setIncremental(true);
+				break;
+			case 'W':
+				generator.setSurfaceCache(optarg);
+				break;
+			case 'F':
+				fromCache = optarg;
+				break;
+			case 'J':
+				jobsFile = optarg;
+				break;
+			case 'V':
+				socketPath = optarg;
+				break;
+			case 'M':
+				if (strcmp(optarg, "text") && strcmp(optarg, "json")) {
+					usage();
+					exit(1);
+				}
+				generator.setTimings(!strcmp(optarg, "json"));
+				timings = true;
+				break;
+			case 'A':
+				generator.setTrace(optarg);
+				trace = true;
+				break;
+			case 'G':
+				progressFd = stoi(optarg);
+				if (progressFd < 0) {
+					usage();
+					exit(1);
+				}
+				break;
+			case 'N':
+				progressInterval = stod(optarg);
+				if (progressInterval < 0) {
+					usage();
+					exit(1);
+				}
+				break;
+			case 'T': {
+					int n = stoi(optarg);
+					if (n < 1) {
+						usage();
+						exit(1);
+					}
+					threads = n;
+				}
+				break;
+			case 'B': {
+					int size = stoi(optarg);
+					if (size < 0) {
+						usage();
+						exit(1);
+					}
+					generator.setBlockCacheSize(size);
+				}
+				break;
 			case 'k': {
 				std::istringstream iss(optarg);
 				char c, c2;
@@ -240,17 +384,29 @@ int main(int argc, char *argv[])
 				}
 				break;
 			}
+			case 'x':
+				snapshot = optarg;
+				break;
 			default:
 				exit(1);
 		}
 	}
 
-	const bool need_output = !onlyPrintExtent && dumpblock.x == INT16_MIN;
-	if (input.empty() || (need_output && output.empty())) {
+	const bool need_output = !onlyPrintExtent && dumpblock.x == INT16_MIN &&
+		snapshot.empty() && jobsFile.empty() && socketPath.empty();
+	if ((input.empty() && fromCache.empty()) || (need_output && output.empty())) {
 		usage();
 		return 0;
 	}
 
+	if (progressFd >= 0) {
+#ifndef _WIN32
+		// a reader that went away makes writing fail instead of killing us
+		signal(SIGPIPE, SIG_IGN);
+#endif
+		generator.setProgressFd(progressFd, progressInterval);
+	}
+
 	try {
 
 		if (onlyPrintExtent) {
@@ -259,12 +415,30 @@ int main(int argc, char *argv[])
 		} else if (dumpblock.x != INT16_MIN) {
 			generator.dumpBlock(input, dumpblock);
 			return 0;
+		} else if (!snapshot.empty()) {
+			generator.exportSnapshot(input, snapshot);
+			return 0;
 		}
 
 		if(colors.empty())
-			colors = search_colors(input);
+			colors = search_colors(input.empty() ? "." : input);
 		generator.parseColorsFile(colors);
-		generator.generate(input, output);
+		if (!jobsFile.empty() || !socketPath.empty()) {
+			if (!fromCache.empty())
+				throw std::runtime_error("--from-cache can't be used with --jobs or --serve");
+			if (!socketPath.empty() && timings)
+				throw std::runtime_error("--timings can't be used with --serve");
+			// the spans of all requests would pile up until the server stops
+			if (!socketPath.empty() && trace)
+				throw std::runtime_error("--trace can't be used with --serve");
+			if (!socketPath.empty())
+				generator.serve(input, socketPath, threads);
+			else
+				generator.generateJobs(input, read_jobs(jobsFile), threads);
+		} else if (!fromCache.empty())
+			generator.generateFromCache(fromCache, input, output);
+		else
+			generator.generate(input, output);
 
 	} catch (const std::exception &e) {
 		std::cerr << "Exception: " << e.what() << std::endl;
@@ -0,0 +1,61 @@
+/* Renders a world into memory through MapRenderer, like a program using
+ * libminetestmapper would, and writes the PNG so it can be compared with
+ * the image minetestmapper renders.
+ */
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "MapRenderer.h"
+
+static void check(bool ok, const char *what)
+{
+	if (!ok)
+		throw std::runtime_error(what);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 4) {
+		std::cerr << "Usage: " << argv[0] << " <world> <colors.txt> <output.png>" << std::endl;
+		return 2;
+	}
+
+	try {
+		MapRenderer renderer(argv[1], argv[2]);
+		MapRenderOptions options;
+
+		int x, z, w, h;
+		check(renderer.getExtent(options, x, z, w, h), "The map is empty");
+		check(w > 0 && h > 0 && w % 16 == 0 && h % 16 == 0, "Odd extent");
+
+		int width, height;
+		renderer.getImageSize(options, width, height);
+		std::vector<uint8_t> rgba(width * height * 4);
+		renderer.renderRGBA(options, rgba.data(), width, height);
+		bool drawn = false;
+		for (size_t i = 3; i < rgba.size() && !drawn; i += 4)
+			drawn = rgba[i] == 255;
+		check(drawn, "Nothing was drawn");
+
+		bool refused = false;
+		try {
+			renderer.renderRGBA(options, rgba.data(), width + 1, height);
+		} catch (const std::runtime_error &) {
+			refused = true;
+		}
+		check(refused, "A buffer of the wrong size was accepted");
+
+		std::ofstream os(argv[3], std::ios::binary);
+		os << renderer.renderPNG(options);
+		check(os.good(), "Failed to write the image");
+	} catch (const std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
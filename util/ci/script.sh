@@ -12,6 +12,7 @@ run_build() {
 	local args=(
 		-DCMAKE_BUILD_TYPE=Debug
 		-DENABLE_LEVELDB=1 -DENABLE_POSTGRESQL=1 -DENABLE_REDIS=1
+		-DBUILD_TESTS=1
 	)
 	[[ "$CXX" == clang* ]] && args+=(-DCMAKE_CXX_FLAGS="-fsanitize=address")
 	cmake . "${args[@]}"
@@ -29,4 +30,51 @@ END
 
 	./minetestmapper --noemptyimage -i ./testmap -o map.png
 	file map.png
+
+	# a snapshot has to render the same as the map it was exported from
+	./minetestmapper -i ./testmap --export-snapshot map.snap
+	./minetestmapper --noemptyimage --backend snapshot -i map.snap -o snap.png
+	cmp map.png snap.png
+
+	# and so does a stream of the block: X, Y, Z, length (little endian), data
+	sqlite3 testmap/map.sqlite "SELECT writefile('block.bin', data) FROM blocks;"
+	local len=$(stat -c %s block.bin)
+	{
+		printf '\0\0\0\0\0\0'
+		printf "$(printf '\\%03o' $((len & 255)) $((len >> 8 & 255)) \
+			$((len >> 16 & 255)) $((len >> 24 & 255)))"
+		cat block.bin
+	} | ./minetestmapper --noemptyimage --backend stream -i - -o stream.png
+	cmp map.png stream.png
+
+	# rendering from a surface cache as well
+	./minetestmapper -i ./testmap --save-cache map.surface -o /dev/null
+	./minetestmapper --noemptyimage --from-cache map.surface -o cache.png
+	cmp map.png cache.png
+
+	# and through the library
+	./maprenderer_test ./testmap colors.txt lib.png
+	cmp map.png lib.png
+}
+
+# needs a PostgreSQL server given by $PG_CONNECTION
+do_postgresql_test() {
+	mkdir pgmap
+	printf '%s\n' "backend = postgresql" "pgsql_connection = $PG_CONNECTION" >pgmap/world.mt
+	# a few rows, so that several row queries can be in flight
+	psql -v ON_ERROR_STOP=1 "$PG_CONNECTION" <<END
+CREATE TABLE blocks(posX INT NOT NULL, posY INT NOT NULL, posZ INT NOT NULL,
+	data BYTEA, PRIMARY KEY(posX, posY, posZ));
+INSERT INTO blocks SELECT x, 0, z, decode('$(cat util/ci/test_block)', 'hex')
+	FROM generate_series(-2, 1) x, generate_series(-3, 2) z;
+END
+
+	./minetestmapper --noemptyimage -i ./pgmap -o pg.png --timings text
+	file pg.png
+	./minetestmapper --noemptyimage -i ./pgmap -o pg_pipeline.png --timings text \
+		--backend-option pipeline_depth=4
+	cmp pg.png pg_pipeline.png
+	./minetestmapper --noemptyimage -i ./pgmap -o pg_cursor.png \
+		--backend-option cursor_batch=5
+	cmp pg.png pg_cursor.png
 }